@@ -0,0 +1,174 @@
+#ifndef GALAXY_AUTOTUNE_H
+#define GALAXY_AUTOTUNE_H
+
+#include <vector>
+#include <span>
+#include <chrono>
+#include <random>
+#include <numeric>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <optional>
+#include <iostream>
+
+#include "kernels.hpp"
+#include "parallel.hpp"
+#include "spatial.hpp"
+#include "config.hpp"
+#include "stats.hpp"
+
+
+namespace autotune {
+	/*
+	 * Picks `theta` and the leaf capacity of a tree solver from
+	 * `[simulation.engine.autotune]`.
+	 *
+	 * A fixed random sample of bodies gets exact accelerations by direct
+	 * summation. A fresh solver is then built and evaluated for every
+	 * combination of the `theta` and `leaf_capacity` grids, measuring its
+	 * time and the RMS relative acceleration error over the sample. The
+	 * fastest combination within `error` wins, the most accurate one if none
+	 * is.
+	 */
+	class Tuner {
+	private:
+		std::vector<double> thetas_;
+		std::vector<std::size_t> leaf_capacities_;
+		std::size_t samples_;
+		std::size_t repeat_;
+		double max_error_;
+		std::size_t interval_;
+
+		bool tuned_ = false;
+
+	public:
+		struct Result {
+			double theta;
+			std::size_t leaf_capacity;
+			double error;
+			double ms;
+		};
+
+		Tuner(config::Config cfg) {
+			thetas_ = cfg.get_array<double>("simulation.engine.autotune.theta").value_or(
+				std::vector<double> {0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 1.0}
+			);
+			leaf_capacities_ = cfg.get_array<std::size_t>("simulation.engine.autotune.leaf_capacity").value_or(
+				std::vector<std::size_t> {1, 2, 4, 8, 16, 32, 64}
+			);
+			samples_ = cfg.get<std::size_t>("simulation.engine.autotune.samples").value_or(256);
+			repeat_ = std::max<std::size_t>(1, cfg.get<std::size_t>("simulation.engine.autotune.repeat").value_or(1));
+			max_error_ = cfg.get<double>("simulation.engine.autotune.error").value_or(1e-3);
+			interval_ = cfg.get<std::size_t>("simulation.engine.autotune.interval").value_or(0);
+
+			if (thetas_.empty() || leaf_capacities_.empty() || std::ranges::count(leaf_capacities_, 0) > 0 || samples_ == 0) {
+				throw config::configuration_error("Invalid configuration at 'simulation.engine.autotune'.");
+			}
+		}
+
+		/* Whether to tune before step `step`: before the first one and then every `interval` steps. */
+		bool due(std::size_t step) const {
+			return !tuned_ || (interval_ > 0 && step % interval_ == 0);
+		}
+
+		template<typename Solver, typename Body>
+		Result tune(config::Config cfg, const config::Units& units, const spatial::Box<typename Body::Scalar, Body::Dim>& bbox, const std::vector<Body>& bodies, parallel::ThreadPool& pool) {
+			using Scalar = typename Body::Scalar;
+			using Vector = typename Body::Vector;
+			using Clock = std::chrono::steady_clock;
+
+			tuned_ = true;
+
+			// Exact accelerations of the sample
+			std::vector<std::size_t> all(bodies.size());
+			std::iota(all.begin(), all.end(), 0);
+
+			std::vector<std::size_t> sample(std::min(samples_, bodies.size()));
+			std::mt19937 gen(0);
+			std::ranges::sample(all, sample.begin(), sample.size(), gen);
+
+			kernels::Particles<Scalar, Body::Dim> particles;
+			particles.assign(bodies, std::span<const std::size_t>(all), pool);
+
+			auto isa = kernels::select<Scalar>(cfg);
+			Scalar G = units.G();
+			auto eps = cfg.get_or_fail<Scalar>("simulation.engine.eps");
+
+			std::vector<Vector> exact(sample.size());
+			pool.for_each(sample.size(), [&](std::size_t begin, std::size_t end) {
+				for (std::size_t k = begin; k < end; ++k) {
+					auto& body = bodies[sample[k]];
+					exact[k] = kernels::p2p(isa, particles, 0, particles.size(), body.pos, body.mass, G, eps).first;
+				}
+			}, 1);
+
+			std::vector<Body> trial;
+			std::vector<Vector> acc(bodies.size());
+			std::vector<std::size_t> where(bodies.size());
+
+			Result best { 0, 0, std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity() };
+			Result most_accurate { thetas_.front(), leaf_capacities_.front(), best.error, best.ms };
+
+			for (auto leaf_capacity : leaf_capacities_) {
+				for (auto theta : thetas_) {
+					// A fresh solver per repetition, a kept one would refit its old tree
+					std::optional<Solver> solver;
+					double ms = std::numeric_limits<double>::infinity();
+					std::span<const typename Solver::TreeType::Index> permutation;
+					for (std::size_t r = 0; r < repeat_; ++r) {
+						trial = bodies;
+						solver.emplace(cfg, units, bbox);
+						solver->theta = theta;
+						solver->set_leaf_capacity(leaf_capacity);
+
+						auto start = Clock::now();
+						permutation = solver->update(trial, pool);
+						solver->evaluate(trial, acc, pool);
+						std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+						ms = std::min(ms, elapsed.count());
+					}
+
+					// The solver may have reordered the bodies
+					std::iota(where.begin(), where.end(), 0);
+					for (std::size_t k = 0; k < permutation.size(); ++k) {
+						where[permutation[k]] = k;
+					}
+
+					double error = 0;
+					for (std::size_t k = 0; k < sample.size(); ++k) {
+						auto norm = exact[k].norm_squared();
+						if (norm > 0) {
+							error += (acc[where[sample[k]]] - exact[k]).norm_squared() / norm;
+						}
+					}
+					error = std::sqrt(error / sample.size());
+
+					Result res { theta, leaf_capacity, error, ms };
+					if (error <= max_error_ && ms < best.ms) {
+						best = res;
+					}
+					if (error < most_accurate.error) {
+						most_accurate = res;
+					}
+				}
+			}
+
+			// Walks of the trial solvers do not belong to any step
+			if constexpr (stats::enabled) {
+				stats::registry.collect();
+			}
+
+			if (best.leaf_capacity == 0) {
+				std::cout << "[autotune::Tuner] Warning: No setting reaches error " << max_error_ << ", using the most accurate one." << std::endl;
+				best = most_accurate;
+			}
+
+			std::cout << "[autotune::Tuner] Info: theta " << best.theta << ", leaf capacity " << best.leaf_capacity
+				<< " (error " << best.error << ", " << best.ms << " ms per evaluation)." << std::endl;
+			return best;
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,453 @@
+#ifndef GALAXY_BARNES_HUT_H
+#define GALAXY_BARNES_HUT_H
+
+#include <vector>
+#include <span>
+#include <utility>
+#include <tuple>
+#include <cmath>
+#include <algorithm>
+
+#include "orthtree.hpp"
+#include "gravity.hpp"
+#include "kernels.hpp"
+#include "parallel.hpp"
+#include "spatial.hpp"
+#include "config.hpp"
+#include "stats.hpp"
+
+
+namespace barnes_hut {
+	/*
+	 * Barnes-Hut force solver, every body walks the tree on its own and
+	 * approximates nodes far enough away (size < theta * distance from their
+	 * center of mass) by their multipole expansion up to `Order` (see
+	 * gravity::Moments).
+	 *
+	 * With `simulation.engine.group_size` set, bodies of the same small
+	 * subtree share one walk instead. The distance is then measured to the
+	 * bounding box of the group, so every accepted node would be accepted by
+	 * each of its bodies too. The walk produces an interaction list of
+	 * particles (bodies of opened leaves, and accepted nodes as point masses
+	 * for monopoles), which is streamed through the P2P kernel for every body
+	 * of the group.
+	 */
+	template<typename Body, std::size_t Order = 1>
+	class Solver {
+	public:
+		using Scalar = typename Body::Scalar;
+		using Vector = typename Body::Vector;
+		using Point = typename Body::Point;
+
+	private:
+		struct TreePolicy {
+			using Item = Body;
+			using NumType = typename Body::Scalar;
+			using GetPoint = typename Body::GetPoint;
+
+			static constexpr bool use_accum = true;
+			/* The total momentum gives the velocity of the center of mass, for jerks. */
+			struct AccumType : gravity::Moments<Scalar, Body::Dim, Order> {
+				Vector momentum;
+			};
+			struct Accum {
+				void operator()(AccumType& cur, const Body& body) const {
+					cur.add(body.pos, body.mass);
+					cur.momentum += body.vel*body.mass;
+				}
+			};
+			struct Merge {
+				void operator()(AccumType& cur, const AccumType& other) const {
+					cur.merge(other);
+					cur.momentum += other.momentum;
+				}
+			};
+
+			std::size_t node_capacity = 1;
+		} tree_policy;
+
+	public:
+		using TreeType = orthtree::OrthTree<Body, Body::Dim, TreePolicy>;
+
+	private:
+		TreeType tree_;
+		spatial::Box<Scalar, Body::Dim> bbox_;
+
+		bool morton_build_;
+		bool sort_bodies_;
+
+		std::size_t rebuild_interval_;
+		Scalar max_escaped_;
+		std::size_t steps_since_rebuild_ = 0;
+
+		kernels::Isa isa_;
+		kernels::Particles<Scalar, Body::Dim> particles_;
+
+		using Node = typename TreeType::Node;
+		using Index = typename TreeType::Index;
+
+		std::size_t group_size_;
+		std::vector<Index> groups_;
+
+		struct InteractionList {
+			kernels::Particles<Scalar, Body::Dim> particles;
+			/* Accepted nodes of higher orders, evaluated by their moments. */
+			std::vector<Index> nodes;
+			/* Number of accepted nodes, of any order. */
+			std::size_t cells = 0;
+		};
+
+		std::span<const Index> build_tree(std::vector<Body>& bodies, parallel::ThreadPool& pool) {
+			steps_since_rebuild_ = 0;
+
+			if (!morton_build_) {
+				tree_.build(bbox_, bodies);
+				return {};
+			}
+
+			tree_.build_morton(bbox_, bodies, pool);
+			if (sort_bodies_) {
+				return tree_.sort_elements(bodies);
+			}
+			return {};
+		}
+
+		void select_groups(const Node& node) {
+			if (node.empty()) {
+				return;
+			}
+
+			if (node.is_leaf() || node.size() <= group_size_) {
+				groups_.push_back(tree_.index(node));
+			} else {
+				for (auto&& child : tree_.children(node)) {
+					select_groups(child);
+				}
+			}
+		}
+
+		void walk_group(const spatial::Box<Scalar, Body::Dim>& group, const Node& node, InteractionList& list) const {
+			if (node.empty()) {
+				return;
+			}
+
+			auto& moments = node.accum_value;
+
+			if (node.bbox.s() < theta*group.distance(moments.center)) {
+				if constexpr (Order == 1) {
+					list.particles.push_back(moments.center, moments.mass);
+				} else {
+					list.nodes.push_back(tree_.index(node));
+				}
+				++list.cells;
+			} else if (node.is_leaf()) {
+				stats::count(stats::Counter::NODES_OPENED);
+				list.particles.append(particles_, node.begin, node.end);
+			} else {
+				stats::count(stats::Counter::NODES_OPENED);
+				for (auto&& child : tree_.children(node)) {
+					walk_group(group, child, list);
+				}
+			}
+		}
+
+		Scalar evaluate_group(const std::vector<Body>& bodies, const Node& group, InteractionList& list, std::span<Vector> acc) const {
+			auto indices = tree_.indices(group);
+
+			spatial::Box<Scalar, Body::Dim> box(bodies[indices[0]].pos, Vector());
+			for (auto i : indices) {
+				box.include(bodies[i].pos);
+			}
+
+			list.particles.clear();
+			list.nodes.clear();
+			list.cells = 0;
+			walk_group(box, tree_.root(), list);
+
+			// Monopoles of accepted nodes are in the particle list too
+			auto particles = list.particles.size() - (Order == 1 ? list.cells : 0);
+			stats::count(stats::Counter::CELL_INTERACTIONS, indices.size()*list.cells);
+			stats::count(stats::Counter::PARTICLE_INTERACTIONS, indices.size()*particles);
+
+			Scalar pot_sum = 0.;
+			for (auto i : indices) {
+				auto [a, pot] = kernels::p2p(isa_, list.particles, 0, list.particles.size(), bodies[i].pos, bodies[i].mass, G, eps);
+				for (auto idx : list.nodes) {
+					auto [node_acc, node_pot] = tree_.nodes()[idx].accum_value.field(G, eps, bodies[i].pos, bodies[i].mass);
+					a += node_acc;
+					pot += node_pot;
+				}
+				acc[i] = a;
+				pot_sum += pot;
+			}
+			return pot_sum;
+		}
+
+		/*
+		 * Evaluates bodies for which `active(i)` holds, groups with at least one
+		 * such body are evaluated whole. Returns the potential energy of the
+		 * evaluated bodies.
+		 */
+		template<typename Active>
+		Scalar evaluate_where(const std::vector<Body>& bodies, std::span<Vector> acc, parallel::ThreadPool& pool, Active&& active) const {
+			auto walk = [&](std::size_t i) {
+				auto [a, pot] = traverse(bodies[i], tree_.root());
+				acc[i] = a;
+				return pot;
+			};
+
+			if (group_size_ == 0) {
+				return pool.reduce(bodies.size(), (Scalar)0., [&](std::size_t begin, std::size_t end) {
+					Scalar pot_sum = 0.;
+					for (std::size_t i = begin; i < end; ++i) {
+						if (active(i)) {
+							pot_sum += walk(i);
+						}
+					}
+					return pot_sum;
+				});
+			}
+
+			auto pot_groups = pool.reduce(groups_.size(), (Scalar)0., [&](std::size_t begin, std::size_t end) {
+				InteractionList list;
+				Scalar pot_sum = 0.;
+				for (std::size_t g = begin; g < end; ++g) {
+					auto& group = tree_.nodes()[groups_[g]];
+					if (std::ranges::any_of(tree_.indices(group), active)) {
+						pot_sum += evaluate_group(bodies, group, list, acc);
+					}
+				}
+				return pot_sum;
+			}, 8);
+
+			// Bodies outside of the tree are in no group.
+			auto outside = tree_.outside();
+			return pot_groups + pool.reduce(outside.size(), (Scalar)0., [&](std::size_t begin, std::size_t end) {
+				Scalar pot_sum = 0.;
+				for (std::size_t k = begin; k < end; ++k) {
+					if (active(outside[k])) {
+						pot_sum += walk(outside[k]);
+					}
+				}
+				return pot_sum;
+			});
+		}
+
+		std::pair<Vector, Scalar> traverse(const Body& body, const Node& node) const {
+			Vector res_acc;
+			Scalar res_pot = 0.;
+
+			if (node.empty()) {
+				return std::make_pair(res_acc, res_pot);
+			}
+
+			auto& moments = node.accum_value;
+			auto d = (body.pos-moments.center).norm();
+
+			if (node.bbox.s() < theta*d) {
+				//assert(!node.bbox.contains(body.pos));
+				auto [acc, pot] = moments.field(G, eps, body.pos, body.mass);
+				res_acc += acc;
+				res_pot += pot;
+				stats::count(stats::Counter::CELL_INTERACTIONS);
+			} else {
+				stats::count(stats::Counter::NODES_OPENED);
+				if (node.is_leaf()) {
+					stats::count(stats::Counter::PARTICLE_INTERACTIONS, node.size());
+					auto [acc, pot] = kernels::p2p(isa_, particles_, node.begin, node.end, body.pos, body.mass, G, eps);
+					res_acc += acc;
+					res_pot += pot;
+				} else {
+					for (auto&& child : tree_.children(node)) {
+						auto [acc, pot] = traverse(body, child);
+						res_acc += acc;
+						res_pot += pot;
+					}
+				}
+			}
+
+			return std::make_pair(res_acc, res_pot);
+		}
+
+		/*
+		 * Acceleration, jerk and potential of `body`, like traverse(). Jerks of
+		 * accepted nodes are of their monopole moving with the center of mass,
+		 * leaves are summed body by body.
+		 */
+		std::tuple<Vector, Vector, Scalar> traverse_jerk(const std::vector<Body>& bodies, const Body& body, const Node& node) const {
+			Vector res_acc, res_jerk;
+			Scalar res_pot = 0.;
+
+			if (node.empty()) {
+				return std::make_tuple(res_acc, res_jerk, res_pot);
+			}
+
+			auto& moments = node.accum_value;
+			auto d = (body.pos-moments.center).norm();
+
+			if (node.bbox.s() < theta*d) {
+				auto [acc, pot] = moments.field(G, eps, body.pos, body.mass);
+				res_acc += acc;
+				res_pot += pot;
+				if (moments.mass > 0) {
+					res_jerk += jerk_of(moments.center - body.pos, moments.momentum/moments.mass - body.vel, moments.mass);
+				}
+				stats::count(stats::Counter::CELL_INTERACTIONS);
+			} else {
+				stats::count(stats::Counter::NODES_OPENED);
+				if (node.is_leaf()) {
+					stats::count(stats::Counter::PARTICLE_INTERACTIONS, node.size());
+					auto [acc, pot] = kernels::p2p(isa_, particles_, node.begin, node.end, body.pos, body.mass, G, eps);
+					res_acc += acc;
+					res_pot += pot;
+					// The body itself adds no jerk, r and v are zero
+					for (auto k : tree_.indices(node)) {
+						res_jerk += jerk_of(bodies[k].pos - body.pos, bodies[k].vel - body.vel, bodies[k].mass);
+					}
+				} else {
+					for (auto&& child : tree_.children(node)) {
+						auto [acc, jerk, pot] = traverse_jerk(bodies, body, child);
+						res_acc += acc;
+						res_jerk += jerk;
+						res_pot += pot;
+					}
+				}
+			}
+
+			return std::make_tuple(res_acc, res_jerk, res_pot);
+		}
+
+		/* Softened jerk of a point mass at relative position `r` and velocity `v`. */
+		Vector jerk_of(const Vector& r, const Vector& v, Scalar mass) const {
+			auto inv2 = 1/(r.norm_squared() + eps*eps);
+			auto m_inv3 = G*mass*inv2*std::sqrt(inv2);
+
+			Scalar rv = 0;
+			for (std::size_t d = 0; d < Body::Dim; ++d) {
+				rv += r[d]*v[d];
+			}
+			return (v - r*(3*rv*inv2))*m_inv3;
+		}
+
+	public:
+		Scalar theta;
+		Scalar eps;
+		Scalar G;
+
+		Solver(config::Config cfg, const config::Units& units, const spatial::Box<Scalar, Body::Dim>& bbox): tree_(tree_policy), bbox_(bbox) {
+			G = units.G();
+			theta = cfg.get_or_fail<Scalar>("simulation.engine.theta");
+			eps = cfg.get_or_fail<Scalar>("simulation.engine.eps");
+
+			auto build = cfg.get<std::string>("simulation.engine.tree.build").value_or("partition");
+			if (build == "morton") {
+				morton_build_ = true;
+			} else if (build == "partition") {
+				morton_build_ = false;
+			} else {
+				config::backend_fail("tree build");
+			}
+			tree_policy.node_capacity = cfg.get<std::size_t>("simulation.engine.leaf_capacity").value_or(tree_policy.node_capacity);
+			sort_bodies_ = cfg.get<bool>("simulation.engine.tree.sort_bodies").value_or(true);
+
+			rebuild_interval_ = std::max<std::size_t>(1, cfg.get<std::size_t>("simulation.engine.tree.rebuild_interval").value_or(1));
+			max_escaped_ = cfg.get<Scalar>("simulation.engine.tree.max_escaped").value_or(0.01);
+
+			isa_ = kernels::select<Scalar>(cfg);
+
+			group_size_ = cfg.get<std::size_t>("simulation.engine.group_size").value_or(0);
+		}
+
+		/*
+		 * Rebuilds the tree every `rebuild_interval_` steps and refits it in
+		 * between. Rebuilds early once too many bodies left their leaf cells.
+		 * May reorder `bodies`, returns the permutation applied to them (see
+		 * OrthTree::sort_elements()), empty if they kept their order.
+		 */
+		std::span<const Index> update(std::vector<Body>& bodies, parallel::ThreadPool& pool) {
+			std::span<const Index> permutation;
+			if (tree_.nodes().empty() || steps_since_rebuild_ + 1 >= rebuild_interval_) {
+				permutation = build_tree(bodies, pool);
+			} else if (tree_.refit(bodies) > max_escaped_*bodies.size()) {
+				permutation = build_tree(bodies, pool);
+			} else {
+				++steps_since_rebuild_;
+			}
+
+			particles_.assign(bodies, tree_.indices(tree_.root()), pool);
+
+			groups_.clear();
+			if (group_size_ > 0) {
+				select_groups(tree_.root());
+			}
+
+			return permutation;
+		}
+
+		/*
+		 * Refits the tree and its moments to the moved bodies, for the
+		 * substeps of block timesteps. Rebuilds it like update() once too
+		 * many bodies left their leaf cells, returns the permutation then.
+		 */
+		std::span<const Index> refit(std::vector<Body>& bodies, parallel::ThreadPool& pool) {
+			std::span<const Index> permutation;
+			if (tree_.refit(bodies) > max_escaped_*bodies.size()) {
+				permutation = build_tree(bodies, pool);
+				groups_.clear();
+				if (group_size_ > 0) {
+					select_groups(tree_.root());
+				}
+			}
+
+			particles_.assign(bodies, tree_.indices(tree_.root()), pool);
+			return permutation;
+		}
+
+		/* Writes accelerations of `bodies` to `acc` and returns the total potential energy. */
+		Scalar evaluate(const std::vector<Body>& bodies, std::span<Vector> acc, parallel::ThreadPool& pool) const {
+			return evaluate_where(bodies, acc, pool, [](std::size_t) {
+				return true;
+			});
+		}
+
+		/*
+		 * Accelerations with their time derivatives (jerks), for Hermite
+		 * integration. Every body walks the tree on its own, `group_size` is
+		 * not used. Returns the total potential energy.
+		 */
+		Scalar evaluate_jerk(const std::vector<Body>& bodies, std::span<Vector> acc, std::span<Vector> jerk, parallel::ThreadPool& pool) const {
+			return pool.reduce(bodies.size(), (Scalar)0., [&](std::size_t begin, std::size_t end) {
+				Scalar pot_sum = 0.;
+				for (std::size_t i = begin; i < end; ++i) {
+					auto [a, j, pot] = traverse_jerk(bodies, bodies[i], tree_.root());
+					acc[i] = a;
+					jerk[i] = j;
+					pot_sum += pot;
+				}
+				return pot_sum;
+			});
+		}
+
+		/*
+		 * Writes accelerations of bodies with `active[i]` set, others may be
+		 * left as they were or get updated too.
+		 */
+		void evaluate_active(const std::vector<Body>& bodies, std::span<const char> active, std::span<Vector> acc, parallel::ThreadPool& pool) const {
+			evaluate_where(bodies, acc, pool, [active](std::size_t i) {
+				return active[i] != 0;
+			});
+		}
+
+		/* Changes the maximum number of bodies in a leaf, the next update() rebuilds the tree. */
+		void set_leaf_capacity(std::size_t capacity) {
+			tree_policy.node_capacity = capacity;
+			steps_since_rebuild_ = rebuild_interval_;
+		}
+
+		const TreeType& tree() const {
+			return tree_;
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,299 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include "config.hpp"
+#include "spatial.hpp"
+#include "simulation.hpp"
+#include "mass_distribution.hpp"
+#include "integration.hpp"
+#include "parallel.hpp"
+
+#include "graphics/null/graphics.hpp"
+
+
+/*
+ * Usage: galaxy_bench [--n 1000,10000] [--theta 0.3,0.5] [--dim 2,3] [--engine tree,fmm,direct]
+ *                     [--repeat R] [--threads T] [--set key=value]... [--out results.json]
+ *
+ * Generates the standard initial conditions (simple_exponential in 2D,
+ * simple_exponential_sphere in 3D) for every N and dimension, then for every
+ * engine and theta times the tree build (Solver::update()), the force
+ * evaluation and one integration step separately. Results are written as JSON.
+ *
+ * `--set` overrides any configuration value, e.g. --set simulation.engine.group_size=16.
+ */
+struct BenchOptions {
+	std::vector<std::size_t> n = {1000, 10000, 100000};
+	std::vector<double> theta = {0.3, 0.5, 0.8};
+	std::vector<std::size_t> dim = {2, 3};
+	std::vector<std::string> engine = {"tree"};
+	std::size_t repeat = 3;
+	std::size_t threads = 0;
+	std::vector<std::string> overrides;
+	std::string out;
+};
+
+template<typename T>
+std::vector<T> parse_list(const std::string& arg) {
+	std::vector<T> res;
+	std::stringstream ss(arg);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		std::stringstream is(item);
+		T value;
+		if (!(is >> value)) {
+			throw config::configuration_error("Invalid list value " + item + ".");
+		}
+		res.push_back(value);
+	}
+	return res;
+}
+
+BenchOptions parse_args(const std::vector<std::string>& args) {
+	BenchOptions options;
+
+	for (std::size_t i = 0; i < args.size(); ++i) {
+		if (i + 1 >= args.size()) {
+			throw config::configuration_error("Invalid command line argument " + args[i] + ".");
+		}
+
+		auto& value = args[++i];
+		if (args[i - 1] == "--n") {
+			options.n = parse_list<std::size_t>(value);
+		} else if (args[i - 1] == "--theta") {
+			options.theta = parse_list<double>(value);
+		} else if (args[i - 1] == "--dim") {
+			options.dim = parse_list<std::size_t>(value);
+		} else if (args[i - 1] == "--engine") {
+			options.engine = parse_list<std::string>(value);
+		} else if (args[i - 1] == "--repeat") {
+			options.repeat = std::max<std::size_t>(1, std::stoull(value));
+		} else if (args[i - 1] == "--threads") {
+			options.threads = std::stoull(value);
+		} else if (args[i - 1] == "--set") {
+			auto eq = value.find('=');
+			if (eq == std::string::npos) {
+				throw config::configuration_error("Invalid override " + value + ", expected key=value.");
+			}
+			options.overrides.push_back(value.substr(0, eq) + " = " + value.substr(eq + 1));
+		} else if (args[i - 1] == "--out") {
+			options.out = value;
+		} else {
+			throw config::configuration_error("Invalid command line argument " + args[i - 1] + ".");
+		}
+	}
+
+	return options;
+}
+
+
+/* Copies values of `src` into `dst`, merging nested tables. */
+void merge(toml::table& dst, const toml::table& src) {
+	for (auto&& [key, value] : src) {
+		if (value.is_table() && dst.contains(key) && dst[key].is_table()) {
+			merge(*dst[key].as_table(), *value.as_table());
+		} else {
+			dst.insert_or_assign(key, value);
+		}
+	}
+}
+
+toml::table bench_config(std::size_t dim, std::size_t n, double theta, const std::string& engine, const BenchOptions& options) {
+	std::stringstream ss;
+	ss << "physical.G0 = 6.67430E-11\n"
+		<< "simulation.dim = " << dim << "\n"
+		<< "simulation.units.dist = { val = 0.1, unit = \"kpc\" }\n"
+		<< "simulation.units.time = { val = 1.0, unit = \"Myear\" }\n"
+		<< "simulation.units.mass = { val = 1.0, unit = \"mass_sun\" }\n"
+		<< "simulation.size.extent = { x = 200, y = 200, z = 200 }\n"
+		<< "simulation.mass_distribution.type = \"" << (dim == 2 ? "simple_exponential" : "simple_exponential_sphere") << "\"\n"
+		<< "simulation.mass_distribution.N = " << n << "\n"
+		<< "simulation.mass_distribution.total_mass = 1E11\n"
+		<< "simulation.mass_distribution.lambda = " << (dim == 2 ? 0.05 : 0.1) << "\n"
+		<< "simulation.engine.type = \"" << engine << "\"\n"
+		<< "simulation.engine.eps = 2.5\n"
+		<< "simulation.engine.theta = " << theta << "\n"
+		<< "simulation.engine.threads = " << options.threads << "\n"
+		<< "simulation.integration.type = \"leapfrog\"\n"
+		<< "simulation.integration.dt = 1.0\n";
+
+	auto tbl = toml::parse(ss.str());
+	for (auto&& o : options.overrides) {
+		merge(tbl, toml::parse(o));
+	}
+	return tbl;
+}
+
+
+struct Timings {
+	std::vector<double> build;
+	std::vector<double> evaluate;
+	std::vector<double> integrate;
+};
+
+double min_of(std::vector<double> v) {
+	return *std::ranges::min_element(v);
+}
+
+double median_of(std::vector<double> v) {
+	std::ranges::sort(v);
+	return v.size() % 2 ? v[v.size()/2] : (v[v.size()/2 - 1] + v[v.size()/2])/2;
+}
+
+template<typename Solver, typename Body>
+Timings run_case(config::Config cfg, const config::Units& units, const std::vector<Body>& initial, std::size_t repeat) {
+	using Clock = std::chrono::steady_clock;
+	auto ms = [](Clock::duration d) {
+		return std::chrono::duration<double, std::milli>(d).count();
+	};
+
+	std::array<typename Body::Scalar, Body::Dim> extent = config::get_coords_or_fail<typename Body::Scalar, Body::Dim>()(cfg, "simulation.size.extent");
+	spatial::Box<typename Body::Scalar, Body::Dim> bbox(typename Body::Point(), extent);
+
+	parallel::ThreadPool pool(cfg.get<std::size_t>("simulation.engine.threads").value_or(0));
+	auto intm = integration::get<Body>(cfg.get_or_fail("simulation.integration"));
+	auto dt = cfg.get_or_fail<double>("simulation.integration.dt");
+
+	Timings res;
+	for (std::size_t r = 0; r < repeat; ++r) {
+		Solver solver(cfg, units, bbox);
+		auto bodies = initial;
+		std::vector<typename Body::Vector> acc(bodies.size());
+		std::vector<typename Body::Vector> jerk(bodies.size());
+
+		auto t0 = Clock::now();
+		solver.update(bodies, pool);
+		auto t1 = Clock::now();
+		solver.evaluate(bodies, acc, pool);
+		auto t2 = Clock::now();
+		// Only the passes over the bodies, the force evaluation is timed above
+		std::visit([&](auto& method) {
+			method.step(bodies, acc, jerk, dt, pool, [] {
+				return std::span<const std::uint32_t>();
+			});
+		}, intm);
+		auto t3 = Clock::now();
+
+		res.build.push_back(ms(t1 - t0));
+		res.evaluate.push_back(ms(t2 - t1));
+		res.integrate.push_back(ms(t3 - t2));
+	}
+	return res;
+}
+
+template<typename Body>
+Timings run_engine(config::Config cfg, const config::Units& units, const std::vector<Body>& initial, std::size_t repeat) {
+	auto type = cfg.get_or_fail<std::string>("simulation.engine.type");
+
+	if (type == "tree") {
+		auto order = cfg.get<std::size_t>("simulation.engine.order").value_or(1);
+
+		if (order == 1) {
+			return run_case<barnes_hut::Solver<Body, 1>>(cfg, units, initial, repeat);
+		} else if (order == 2) {
+			return run_case<barnes_hut::Solver<Body, 2>>(cfg, units, initial, repeat);
+		} else if (order == 3) {
+			return run_case<barnes_hut::Solver<Body, 3>>(cfg, units, initial, repeat);
+		} else {
+			throw config::configuration_error("Unsupported multipole order.");
+		}
+	} else if (type == "fmm") {
+		return run_case<fmm::Solver<Body>>(cfg, units, initial, repeat);
+	} else if (type == "direct") {
+		return run_case<direct::Solver<Body>>(cfg, units, initial, repeat);
+	} else {
+		config::backend_fail("engine");
+		return {};
+	}
+}
+
+void write_stats(std::ostream& out, const std::string& name, const std::vector<double>& values) {
+	out << "\"" << name << "\": {\"min\": " << min_of(values) << ", \"median\": " << median_of(values) << "}";
+}
+
+template<typename Body>
+void run_dim(const BenchOptions& options, std::ostream& out, bool& first) {
+	using Engine = simulation::TreeSimulationEngine<Body, graphics::NullGraphics, 1>;
+
+	for (auto n : options.n) {
+		// Initial conditions are generated once for every N, with a fixed theta
+		auto ic_tbl = bench_config(Body::Dim, n, 0.5, "tree", options);
+		config::Config ic_cfg(ic_tbl);
+		config::Units units(ic_cfg);
+
+		auto intm = integration::get<Body>(ic_cfg.get_or_fail("simulation.integration"));
+		auto mdist = mass_distribution::get<Body, Engine>(ic_cfg.get_or_fail("simulation.mass_distribution"));
+		std::vector<Body> initial = Engine(ic_cfg, units, intm, mdist).bodies;
+
+		for (auto&& engine : options.engine) {
+			for (auto theta : options.theta) {
+				auto tbl = bench_config(Body::Dim, n, theta, engine, options);
+				config::Config cfg(tbl);
+
+				std::cerr << "[galaxy_bench] Info: dim " << Body::Dim << ", N " << n << ", engine " << engine << ", theta " << theta << std::endl;
+				auto t = run_engine<Body>(cfg, units, initial, options.repeat);
+
+				out << (first ? "\n" : ",\n");
+				first = false;
+
+				out << "    {\"dim\": " << Body::Dim << ", \"n\": " << n << ", \"engine\": \"" << engine << "\", \"theta\": " << theta
+					<< ", \"repeat\": " << options.repeat << ", ";
+				write_stats(out, "build_ms", t.build);
+				out << ", ";
+				write_stats(out, "evaluate_ms", t.evaluate);
+				out << ", ";
+				write_stats(out, "integrate_ms", t.integrate);
+				out << "}";
+			}
+		}
+	}
+}
+
+
+int main(int argc, char** argv) {
+	try {
+		auto options = parse_args(std::vector<std::string>(argv + 1, argv + argc));
+
+		std::ofstream file;
+		if (!options.out.empty()) {
+			file.open(options.out);
+			if (!file) {
+				throw config::configuration_error("Unable to open '" + options.out + "'.");
+			}
+		}
+		std::ostream& out = options.out.empty() ? std::cout : file;
+
+		parallel::ThreadPool pool(options.threads);
+
+		out << "{\n  \"threads\": " << pool.size() << ",\n  \"overrides\": [";
+		for (std::size_t i = 0; i < options.overrides.size(); ++i) {
+			auto escaped = options.overrides[i];
+			for (std::size_t p = 0; (p = escaped.find('"', p)) != std::string::npos; p += 2) {
+				escaped.insert(p, "\\");
+			}
+			out << (i ? ", " : "") << "\"" << escaped << "\"";
+		}
+		out << "],\n  \"results\": [";
+
+		bool first = true;
+		for (auto dim : options.dim) {
+			if (dim == 2) {
+				run_dim<simulation::Body2D<double>>(options, out, first);
+			} else if (dim == 3) {
+				run_dim<simulation::Body3D<double>>(options, out, first);
+			} else {
+				throw config::configuration_error("Unsupported simulation dimension.");
+			}
+		}
+
+		out << "\n  ]\n}\n";
+
+	} catch (const std::exception& e) {
+		std::cout << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+}
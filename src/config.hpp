@@ -38,6 +38,28 @@ namespace config {
 			return tbl_->at_path(path).value<T>();
 		}
 
+		/* Values of the array at `path`, empty if there is none. */
+		template<typename T>
+		std::optional<std::vector<T>> get_array(const std::string& path) {
+			auto c = tbl_->at_path(path);
+			if (!c) {
+				return {};
+			}
+			if (!c.is_array()) {
+				throw config::configuration_error("Invalid configuration at '" + path + "'.");
+			}
+
+			std::vector<T> res;
+			for (auto&& node : *c.as_array()) {
+				auto value = node.value<T>();
+				if (!value) {
+					throw config::configuration_error("Invalid configuration at '" + path + "'.");
+				}
+				res.push_back(*value);
+			}
+			return res;
+		}
+
 		template<typename T>
 		T get_or_fail(const std::string& path) {
 			std::optional<T> opt = get<T>(path);
@@ -133,7 +155,7 @@ namespace config {
 			std::string unit;
 			double value;
 
-			double si_value;
+			double si_factor;
 
 			std::string to_string() const {
 				return std::to_string(value) + " " + unit;
@@ -238,7 +260,7 @@ namespace config {
 		}
 
 		double base_unit(Quantity q) const {
-			return unit(q).si_value;
+			return unit(q).si_factor;
 		}
 
 		double G() const {
@@ -0,0 +1,127 @@
+#ifndef GALAXY_DIAGNOSTICS_H
+#define GALAXY_DIAGNOSTICS_H
+
+#include <array>
+#include <vector>
+#include <fstream>
+#include <string>
+#include <cmath>
+
+#include "config.hpp"
+#include "parallel.hpp"
+
+
+namespace diagnostics {
+	/* Conserved quantities of the bodies at one step. */
+	struct Sample {
+		std::size_t step = 0;
+		double time = 0;
+		double kinetic = 0;
+		double potential = 0;
+		std::array<double, 3> momentum = {};
+		std::array<double, 3> angular_momentum = {};
+
+		double energy() const {
+			return kinetic + potential;
+		}
+
+		/* 2K/|W|, 1 in virial equilibrium. */
+		double virial_ratio() const {
+			return potential != 0 ? 2*kinetic/std::abs(potential) : 0.;
+		}
+
+		void operator+=(const Sample& other) {
+			kinetic += other.kinetic;
+			for (std::size_t d = 0; d < 3; ++d) {
+				momentum[d] += other.momentum[d];
+				angular_momentum[d] += other.angular_momentum[d];
+			}
+		}
+	};
+
+	/* Kinetic energy, momentum and angular momentum (about the origin) in one parallel pass. */
+	template<typename Body>
+	Sample measure(const std::vector<Body>& bodies, double potential, parallel::ThreadPool& pool) {
+		auto res = pool.reduce(bodies.size(), Sample {}, [&](std::size_t begin, std::size_t end) {
+			Sample s;
+			for (std::size_t i = begin; i < end; ++i) {
+				auto& b = bodies[i];
+				std::array<double, 3> r = {}, p = {};
+				for (std::size_t d = 0; d < Body::Dim; ++d) {
+					r[d] = b.pos[d];
+					p[d] = b.mass*b.vel[d];
+				}
+
+				s.kinetic += 0.5 * b.mass * b.vel.norm_squared();
+				for (std::size_t d = 0; d < 3; ++d) {
+					s.momentum[d] += p[d];
+				}
+				s.angular_momentum[0] += r[1]*p[2] - r[2]*p[1];
+				s.angular_momentum[1] += r[2]*p[0] - r[0]*p[2];
+				s.angular_momentum[2] += r[0]*p[1] - r[1]*p[0];
+			}
+			return s;
+		}, 4096);
+
+		res.potential = potential;
+		return res;
+	}
+
+	/*
+	 * Time series of the diagnostics, every `simulation.diagnostics.interval`
+	 * steps (0 = never) appended to `simulation.diagnostics.file`, as JSON
+	 * Lines if the name ends with .json or .jsonl, as CSV otherwise. Nothing
+	 * is kept in memory.
+	 */
+	class Log {
+	private:
+		std::size_t interval_ = 0;
+		std::ofstream file_;
+		bool json_ = false;
+
+	public:
+		Log(config::Config cfg) {
+			auto path = cfg.get<std::string>("simulation.diagnostics.file");
+			interval_ = cfg.get<std::size_t>("simulation.diagnostics.interval").value_or(path ? 100 : 0);
+			if (!path || interval_ == 0) {
+				interval_ = 0;
+				return;
+			}
+
+			file_.open(*path, std::ios::trunc);
+			if (!file_) {
+				throw config::configuration_error("Unable to open '" + *path + "'.");
+			}
+
+			json_ = path->ends_with(".json") || path->ends_with(".jsonl");
+			if (!json_) {
+				file_ << "step,time,kinetic,potential,energy,virial_ratio,px,py,pz,lx,ly,lz\n";
+			}
+		}
+
+		bool due(std::size_t step) const {
+			return interval_ > 0 && step % interval_ == 0;
+		}
+
+		void write(const Sample& s) {
+			if (json_) {
+				file_ << "{\"step\": " << s.step << ", \"time\": " << s.time
+					<< ", \"kinetic\": " << s.kinetic << ", \"potential\": " << s.potential
+					<< ", \"energy\": " << s.energy() << ", \"virial_ratio\": " << s.virial_ratio()
+					<< ", \"momentum\": [" << s.momentum[0] << ", " << s.momentum[1] << ", " << s.momentum[2] << "]"
+					<< ", \"angular_momentum\": [" << s.angular_momentum[0] << ", " << s.angular_momentum[1] << ", " << s.angular_momentum[2] << "]}\n";
+			} else {
+				file_ << s.step << "," << s.time << "," << s.kinetic << "," << s.potential << "," << s.energy() << "," << s.virial_ratio();
+				for (auto p : s.momentum) {
+					file_ << "," << p;
+				}
+				for (auto l : s.angular_momentum) {
+					file_ << "," << l;
+				}
+				file_ << "\n";
+			}
+		}
+	};
+}
+
+#endif
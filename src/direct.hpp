@@ -0,0 +1,194 @@
+#ifndef GALAXY_DIRECT_H
+#define GALAXY_DIRECT_H
+
+#include <vector>
+#include <span>
+#include <numeric>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+
+#include "orthtree.hpp"
+#include "kernels.hpp"
+#include "parallel.hpp"
+#include "spatial.hpp"
+#include "config.hpp"
+#include "stats.hpp"
+
+
+namespace direct {
+	/*
+	 * Exact solver summing over all pairs of bodies, for small systems and
+	 * as the reference for the approximate ones.
+	 *
+	 * Bodies are cut into tiles of `simulation.engine.tile` bodies. Every
+	 * pair of tiles is evaluated once by the symmetric P2P kernel, which
+	 * updates both tiles (Newton's third law). The tile pairs are scheduled
+	 * in rounds of disjoint pairs (round-robin tournament), so the pairs of
+	 * one round run in parallel without sharing any tile, and every tile
+	 * sums its contributions in the same order for any number of threads.
+	 *
+	 * The tree is a single leaf with all bodies, only for the graphics.
+	 */
+	template<typename Body>
+	class Solver {
+	public:
+		using Scalar = typename Body::Scalar;
+		using Vector = typename Body::Vector;
+		using Point = typename Body::Point;
+
+	private:
+		orthtree::OrthTreeItemPolicy<Body> tree_policy;
+
+	public:
+		using TreeType = orthtree::OrthTree<Body, Body::Dim, orthtree::OrthTreeItemPolicy<Body>>;
+
+	private:
+		using Index = typename TreeType::Index;
+
+		TreeType tree_;
+		spatial::Box<Scalar, Body::Dim> bbox_;
+
+		std::size_t tile_;
+		std::vector<Index> order_;
+
+		kernels::Isa isa_;
+		kernels::Particles<Scalar, Body::Dim> particles_;
+		kernels::Field<Scalar, Body::Dim> field_;
+
+		void interact_tiles(std::size_t a, std::size_t b) {
+			auto n = particles_.size();
+			kernels::p2p_pairs(isa_, particles_, field_,
+				a*tile_, std::min(n, (a + 1)*tile_),
+				b*tile_, std::min(n, (b + 1)*tile_),
+				eps
+			);
+		}
+
+	public:
+		Scalar eps;
+		Scalar G;
+
+		Solver(config::Config cfg, const config::Units& units, const spatial::Box<Scalar, Body::Dim>& bbox): tree_(tree_policy), bbox_(bbox) {
+			G = units.G();
+			eps = cfg.get_or_fail<Scalar>("simulation.engine.eps");
+
+			// Whole vectors of the widest kernel, only the last tile has a tail
+			tile_ = cfg.get<std::size_t>("simulation.engine.tile").value_or(128);
+			tile_ = std::max<std::size_t>(kernels::padding, tile_ / kernels::padding * kernels::padding);
+
+			tree_policy.node_capacity = std::numeric_limits<std::size_t>::max();
+
+			isa_ = kernels::select<Scalar>(cfg);
+		}
+
+		/* Gathers the bodies for the kernel, never reorders them. */
+		std::span<const Index> update(std::vector<Body>& bodies, parallel::ThreadPool& pool) {
+			if (order_.size() != bodies.size()) {
+				order_.resize(bodies.size());
+				std::iota(order_.begin(), order_.end(), 0);
+			}
+			particles_.assign(bodies, std::span<const Index>(order_), pool);
+
+			tree_.build(bbox_, bodies);
+			return {};
+		}
+
+		/* Same as update(). */
+		std::span<const Index> refit(std::vector<Body>& bodies, parallel::ThreadPool& pool) {
+			return update(bodies, pool);
+		}
+
+		/* Writes accelerations of `bodies` to `acc` and returns the total potential energy. */
+		Scalar evaluate(const std::vector<Body>& bodies, std::span<Vector> acc, parallel::ThreadPool& pool) {
+			auto n = bodies.size();
+			if (n == 0) {
+				return 0;
+			}
+
+			auto tiles = (n + tile_ - 1) / tile_;
+			field_.reset(n);
+
+			pool.for_chunks(tiles, [this](std::size_t t) {
+				interact_tiles(t, t);
+			});
+
+			// Circle method: tile `rounds` stays, the others rotate
+			auto rounds = tiles % 2 ? tiles : tiles - 1;
+			for (std::size_t r = 0; r < rounds; ++r) {
+				pool.for_chunks((rounds + 1) / 2, [this, r, rounds, tiles](std::size_t k) {
+					auto a = k == 0 ? rounds : (r + k) % rounds;
+					auto b = (r + rounds - k) % rounds;
+					if (a < tiles && b < tiles) {
+						interact_tiles(a, b);
+					}
+				});
+			}
+
+			stats::count(stats::Counter::PARTICLE_INTERACTIONS, n*(n - 1));
+
+			return pool.reduce(n, (Scalar)0., [&](std::size_t begin, std::size_t end) {
+				Scalar pot_sum = 0.;
+				for (std::size_t i = begin; i < end; ++i) {
+					for (std::size_t d = 0; d < Body::Dim; ++d) {
+						acc[i][d] = G * field_.acc[d][i];
+					}
+					pot_sum += -G * bodies[i].mass * field_.pot[i] / 2;
+				}
+				return pot_sum;
+			}, 4096);
+		}
+
+		/*
+		 * Accelerations with their time derivatives (jerks), for Hermite
+		 * integration. Returns the total potential energy.
+		 */
+		Scalar evaluate_jerk(const std::vector<Body>& bodies, std::span<Vector> acc, std::span<Vector> jerk, parallel::ThreadPool& pool) {
+			auto n = bodies.size();
+			stats::count(stats::Counter::PARTICLE_INTERACTIONS, n*(n - std::min<std::size_t>(n, 1)));
+
+			return pool.reduce(n, (Scalar)0., [&](std::size_t begin, std::size_t end) {
+				Scalar pot_sum = 0.;
+				for (std::size_t i = begin; i < end; ++i) {
+					Vector a, j;
+					Scalar pot = 0;
+					for (std::size_t k = 0; k < n; ++k) {
+						if (k == i) {
+							continue;
+						}
+
+						auto r = bodies[k].pos - bodies[i].pos;
+						auto v = bodies[k].vel - bodies[i].vel;
+						auto inv2 = 1/(r.norm_squared() + eps*eps);
+						auto inv = std::sqrt(inv2);
+						auto m_inv3 = bodies[k].mass*inv*inv2;
+
+						Scalar rv = 0;
+						for (std::size_t d = 0; d < Body::Dim; ++d) {
+							rv += r[d]*v[d];
+						}
+
+						a += r*m_inv3;
+						j += (v - r*(3*rv*inv2))*m_inv3;
+						pot += bodies[k].mass*inv;
+					}
+					acc[i] = a*G;
+					jerk[i] = j*G;
+					pot_sum += -G * bodies[i].mass * pot / 2;
+				}
+				return pot_sum;
+			}, 16);
+		}
+
+		/* All bodies get evaluated, the symmetric kernel cannot skip any. */
+		void evaluate_active(const std::vector<Body>& bodies, std::span<const char>, std::span<Vector> acc, parallel::ThreadPool& pool) {
+			evaluate(bodies, acc, pool);
+		}
+
+		const TreeType& tree() const {
+			return tree_;
+		}
+	};
+}
+
+#endif
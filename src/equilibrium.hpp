@@ -0,0 +1,338 @@
+#ifndef GALAXY_EQUILIBRIUM_H
+#define GALAXY_EQUILIBRIUM_H
+
+#include <vector>
+#include <array>
+#include <functional>
+#include <algorithm>
+#include <numbers>
+#include <cmath>
+
+
+/*
+ * Initial conditions in equilibrium: spherical components sampled from
+ * their isotropic distribution functions and an exponential disk on
+ * circular orbits, all in one common potential.
+ *
+ * The potential is that of the spherically averaged total mass. Every
+ * table lives on one logarithmic radial grid, samplers only interpolate
+ * in them and take random numbers from `rng.uniform()` in [0, 1), so they
+ * can be shared by all threads.
+ */
+namespace equilibrium {
+	using Triple = std::array<double, 3>;
+
+	/* Density profiles, up to normalization. */
+	inline std::function<double(double)> plummer(double a) {
+		return [a](double r) {
+			return std::pow(1 + r*r/(a*a), -2.5);
+		};
+	}
+
+	inline std::function<double(double)> hernquist(double a) {
+		return [a](double r) {
+			auto x = r/a;
+			return 1/(x*(1 + x)*(1 + x)*(1 + x));
+		};
+	}
+
+	/* NFW cut off exponentially beyond the virial radius, so that its mass is finite. */
+	inline std::function<double(double)> nfw(double a, double r_vir) {
+		return [a, r_vir](double r) {
+			auto x = r/a;
+			auto rho = 1/(x*(1 + x)*(1 + x));
+			return r <= r_vir ? rho : rho*std::exp(-(r - r_vir)/(0.1*r_vir));
+		};
+	}
+
+	/* Inverse of a tabulated cumulative distribution, linear between the points. */
+	class InverseCdf {
+	private:
+		std::vector<double> x_;
+		std::vector<double> cdf_;
+
+	public:
+		InverseCdf() = default;
+
+		InverseCdf(std::vector<double> x, std::vector<double> cdf): x_(std::move(x)), cdf_(std::move(cdf)) {
+			auto total = cdf_.back();
+			for (std::size_t i = 0; i < cdf_.size(); ++i) {
+				// Uniform if there is no probability at all
+				cdf_[i] = total > 0 ? cdf_[i]/total : (double)i/(cdf_.size() - 1);
+			}
+		}
+
+		double operator()(double u) const {
+			auto it = std::upper_bound(cdf_.begin(), cdf_.end(), u);
+			if (it == cdf_.begin()) {
+				return x_.front();
+			}
+			if (it == cdf_.end()) {
+				return x_.back();
+			}
+
+			auto i = it - cdf_.begin();
+			auto w = (u - cdf_[i - 1])/(cdf_[i] - cdf_[i - 1]);
+			return x_[i - 1] + w*(x_[i] - x_[i - 1]);
+		}
+	};
+
+	/* Logarithmic radial grid, all tables are sampled at its radii. */
+	class Grid {
+	private:
+		double ln_min_;
+		double step_;
+
+	public:
+		std::vector<double> r;
+
+		Grid(double r_min, double r_max, std::size_t n = 1024): ln_min_(std::log(r_min)), step_(std::log(r_max/r_min)/(n - 1)), r(n) {
+			for (std::size_t i = 0; i < n; ++i) {
+				r[i] = std::exp(ln_min_ + i*step_);
+			}
+		}
+
+		std::size_t size() const {
+			return r.size();
+		}
+
+		/* Grid index `i` and weight `w` of the point `r` lies at, clamped to the grid. */
+		std::pair<std::size_t, double> locate(double radius) const {
+			auto t = std::clamp((std::log(radius) - ln_min_)/step_, 0., (double)(size() - 1));
+			auto i = std::min((std::size_t)t, size() - 2);
+			return {i, t - i};
+		}
+
+		double interpolate(const std::vector<double>& values, double radius) const {
+			auto [i, w] = locate(radius);
+			return (1 - w)*values[i] + w*values[i + 1];
+		}
+
+		/* Enclosed mass of `density` up to every radius, scaled to `total_mass` at the last one. */
+		std::vector<double> enclosed_mass(const std::function<double(double)>& density, double total_mass, double r_max) const {
+			std::vector<double> res(size());
+
+			auto shell = [&](std::size_t i) {
+				return r[i] <= r_max ? 4*std::numbers::pi*density(r[i])*r[i]*r[i]*r[i] : 0.;
+			};
+
+			res[0] = shell(0)/3;
+			for (std::size_t i = 1; i < size(); ++i) {
+				res[i] = res[i - 1] + (shell(i - 1) + shell(i))/2*step_;
+			}
+			for (auto& m : res) {
+				m *= total_mass/res.back();
+			}
+			return res;
+		}
+
+		/* Relative potential psi = -Phi of the spherical distribution with enclosed mass `mass`. */
+		std::vector<double> potential(const std::vector<double>& mass, double G) const {
+			std::vector<double> res(size());
+			res.back() = G*mass.back()/r.back();
+			for (std::size_t i = size() - 1; i-- > 0;) {
+				res[i] = res[i + 1] + G*(mass[i]/r[i] + mass[i + 1]/r[i + 1])/2*step_;
+			}
+			return res;
+		}
+	};
+
+	template<typename Random>
+	Triple isotropic(Random& rng, double length) {
+		auto cos_theta = 2*rng.uniform() - 1;
+		auto sin_theta = std::sqrt(1 - cos_theta*cos_theta);
+		auto phi = 2*std::numbers::pi*rng.uniform();
+		return {length*sin_theta*std::cos(phi), length*sin_theta*std::sin(phi), length*cos_theta};
+	}
+
+	template<typename Random>
+	double normal(Random& rng) {
+		return std::sqrt(-2*std::log1p(-rng.uniform()))*std::cos(2*std::numbers::pi*rng.uniform());
+	}
+
+	/*
+	 * Isotropic spherical component with density `density` truncated at
+	 * `r_max`, in equilibrium in the potential `psi`. Its distribution
+	 * function f(E) comes from Eddington's formula,
+	 *
+	 *   f(E) ~ d/dE integral_0^E (drho/dpsi) dpsi / sqrt(E - psi),
+	 *
+	 * with drho/dpsi constant between the grid points, where the integral
+	 * is exact. Radii are drawn from the inverse of the enclosed mass,
+	 * speeds v = q sqrt(2 psi) from the inverse of the cumulative
+	 * distribution of q^2 f(psi (1 - q^2)), tabulated at every grid radius.
+	 */
+	class Spherical {
+	private:
+		static constexpr std::size_t speeds = 128;
+
+		const Grid* grid_;
+		std::vector<double> psi_;
+		std::vector<double> mass_;
+		std::vector<double> df_;
+
+		InverseCdf ln_radius_;
+		std::vector<InverseCdf> q_;
+
+		double df(double e) const {
+			auto n = psi_.size();
+			if (e >= psi_.front()) {
+				return df_.front();
+			}
+			if (e <= psi_.back()) {
+				return std::max(0., df_.back()*e/psi_.back());
+			}
+
+			auto i = std::upper_bound(psi_.begin(), psi_.end(), e, std::greater<>()) - psi_.begin();
+			i = std::clamp<std::ptrdiff_t>(i, 1, n - 1);
+			auto w = (psi_[i - 1] - e)/(psi_[i - 1] - psi_[i]);
+			return (1 - w)*df_[i - 1] + w*df_[i];
+		}
+
+	public:
+		Spherical(const Grid& grid, const std::function<double(double)>& density, const std::vector<double>& mass, double r_max, const std::vector<double>& psi): grid_(&grid), psi_(psi), mass_(mass) {
+			auto n = grid.size();
+
+			std::vector<double> rho(n);
+			for (std::size_t i = 0; i < n; ++i) {
+				rho[i] = grid.r[i] <= r_max ? density(grid.r[i]) : 0.;
+			}
+
+			// psi falls outwards, beyond the grid rho goes linearly to 0 at psi = 0
+			std::vector<double> slope(n);
+			for (std::size_t i = 0; i + 1 < n; ++i) {
+				slope[i] = (rho[i] - rho[i + 1])/(psi_[i] - psi_[i + 1]);
+			}
+			slope[n - 1] = rho[n - 1]/psi_[n - 1];
+
+			std::vector<double> integral(n);
+			for (std::size_t j = 0; j < n; ++j) {
+				auto e = psi_[j];
+				double sum = slope[n - 1]*2*(std::sqrt(e) - std::sqrt(e - psi_[n - 1]));
+				for (std::size_t i = j; i + 1 < n; ++i) {
+					sum += slope[i]*2*(std::sqrt(e - psi_[i + 1]) - std::sqrt(e - psi_[i]));
+				}
+				integral[j] = sum;
+			}
+
+			df_.resize(n);
+			for (std::size_t j = 0; j < n; ++j) {
+				auto lo = j + 1 < n ? j + 1 : j;
+				auto hi = j > 0 ? j - 1 : j;
+				df_[j] = std::max(0., (integral[hi] - integral[lo])/(psi_[hi] - psi_[lo]));
+			}
+
+			std::vector<double> ln_r(n);
+			for (std::size_t i = 0; i < n; ++i) {
+				ln_r[i] = std::log(grid.r[i]);
+			}
+			ln_radius_ = InverseCdf(ln_r, mass_);
+
+			std::vector<double> q(speeds);
+			for (std::size_t k = 0; k < speeds; ++k) {
+				q[k] = (double)k/(speeds - 1);
+			}
+
+			q_.reserve(n);
+			std::vector<double> cdf(speeds);
+			for (std::size_t i = 0; i < n; ++i) {
+				double prev = 0;
+				cdf[0] = 0;
+				for (std::size_t k = 1; k < speeds; ++k) {
+					auto p = q[k]*q[k]*df(psi_[i]*(1 - q[k]*q[k]));
+					cdf[k] = cdf[k - 1] + (prev + p)/2;
+					prev = p;
+				}
+				q_.emplace_back(q, cdf);
+			}
+		}
+
+		/* Position and velocity of one body. */
+		template<typename Random>
+		std::pair<Triple, Triple> sample(Random& rng) const {
+			auto u = rng.uniform();
+			auto inner = mass_.front()/mass_.back();
+			auto r = u < inner
+				? grid_->r.front()*std::cbrt(u/inner)
+				: std::exp(ln_radius_(u));
+
+			auto [i, w] = grid_->locate(r);
+			auto v = rng.uniform();
+			auto q = (1 - w)*q_[i](v) + w*q_[i + 1](v);
+			auto speed = q*std::sqrt(2*grid_->interpolate(psi_, r));
+
+			return {isotropic(rng, r), isotropic(rng, speed)};
+		}
+	};
+
+	/*
+	 * Exponential disk in the xy plane with surface density ~ exp(-R/R_d),
+	 * truncated at `r_max`, and vertical profile sech^2(z/z0). Bodies move
+	 * on circular orbits of the spherically averaged potential, with radial
+	 * dispersion `dispersion` times the circular velocity (and half of its
+	 * square tangentially), and the vertical dispersion of an isothermal
+	 * sheet, sigma_z^2 = pi G Sigma z0.
+	 */
+	class Disk {
+	private:
+		double total_mass_;
+		double scale_length_;
+		double scale_height_;
+		double dispersion_;
+		double x_max_;
+
+		InverseCdf x_;
+
+		static double cumulative(double x) {
+			return 1 - (1 + x)*std::exp(-x);
+		}
+
+	public:
+		Disk(double total_mass, double scale_length, double scale_height, double dispersion, double r_max): total_mass_(total_mass), scale_length_(scale_length), scale_height_(scale_height), dispersion_(dispersion), x_max_(r_max/scale_length) {
+			std::size_t n = 4096;
+			std::vector<double> x(n), cdf(n);
+			for (std::size_t i = 0; i < n; ++i) {
+				x[i] = x_max_*i/(n - 1);
+				cdf[i] = cumulative(x[i]);
+			}
+			x_ = InverseCdf(x, cdf);
+		}
+
+		/* Mass within the spheres of the grid radii, counted as if within the cylinders. */
+		std::vector<double> enclosed_mass(const Grid& grid) const {
+			std::vector<double> res(grid.size());
+			for (std::size_t i = 0; i < grid.size(); ++i) {
+				res[i] = total_mass_*cumulative(std::min(grid.r[i]/scale_length_, x_max_))/cumulative(x_max_);
+			}
+			return res;
+		}
+
+		/* Position and velocity of one body, `mass` is the total enclosed mass on `grid`. */
+		template<typename Random>
+		std::pair<Triple, Triple> sample(Random& rng, const Grid& grid, const std::vector<double>& mass, double G) const {
+			auto x = x_(rng.uniform());
+			auto R = x*scale_length_;
+			auto phi = 2*std::numbers::pi*rng.uniform();
+			auto u = std::clamp(rng.uniform(), 1e-12, 1 - 1e-12);
+			auto z = scale_height_*std::atanh(2*u - 1);
+
+			auto r = std::sqrt(R*R + z*z);
+			auto v_c2 = r > 0 ? G*grid.interpolate(mass, r)*R*R/(r*r*r) : 0.;
+
+			auto sigma_r = dispersion_*std::sqrt(v_c2);
+			auto surface = total_mass_/(2*std::numbers::pi*scale_length_*scale_length_*cumulative(x_max_))*std::exp(-x);
+			auto sigma_z = std::sqrt(std::numbers::pi*G*surface*scale_height_);
+
+			auto v_r = sigma_r*normal(rng);
+			auto v_phi = std::sqrt(std::max(0., v_c2 - sigma_r*sigma_r)) + sigma_r/std::numbers::sqrt2*normal(rng);
+			auto v_z = sigma_z*normal(rng);
+
+			return {
+				{R*std::cos(phi), R*std::sin(phi), z},
+				{v_r*std::cos(phi) - v_phi*std::sin(phi), v_r*std::sin(phi) + v_phi*std::cos(phi), v_z}
+			};
+		}
+	};
+}
+
+#endif
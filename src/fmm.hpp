@@ -0,0 +1,467 @@
+#ifndef GALAXY_FMM_H
+#define GALAXY_FMM_H
+
+#include <vector>
+#include <span>
+#include <cmath>
+#include <algorithm>
+
+#include "orthtree.hpp"
+#include "gravity.hpp"
+#include "kernels.hpp"
+#include "parallel.hpp"
+#include "spatial.hpp"
+#include "config.hpp"
+#include "stats.hpp"
+
+
+namespace fmm {
+	/*
+	 * Fast multipole force solver with Cartesian expansions.
+	 *
+	 * Every node gets a multipole expansion (mass, center of mass and
+	 * quadrupole) about its center of mass, built bottom-up (P2M, M2M). Nodes
+	 * are then interacted pairwise by a dual tree walk: well separated pairs
+	 * (r_A + r_B < theta * distance) contribute to the local expansion of the
+	 * sink node (M2L), touching leaves interact directly (P2P). Local
+	 * expansions (potential, gradient and Hessian) are shifted down the tree
+	 * (L2L) and evaluated at the bodies (L2P).
+	 *
+	 * The walk is one-sided: interact(A, B) only accumulates the effect of B
+	 * on A. The top of the tree is cut into a fixed set of disjoint sink
+	 * subtrees, which are walked against the whole tree in parallel. The cut
+	 * does not depend on the number of threads, so neither do the results.
+	 */
+	template<typename Body>
+	class Solver {
+	public:
+		using Scalar = typename Body::Scalar;
+		using Vector = typename Body::Vector;
+		using Point = typename Body::Point;
+
+		static constexpr spatial::Dimension Dim = Body::Dim;
+		using Tensor = spatial::Matrix<Scalar, Dim, Dim>;
+
+	private:
+		struct TreePolicy {
+			using Item = Body;
+			using NumType = typename Body::Scalar;
+			using GetPoint = typename Body::GetPoint;
+
+			static constexpr bool use_accum = false;
+			using AccumType = orthtree::EmptyVal;
+
+			std::size_t node_capacity = 16;
+		} tree_policy;
+
+	public:
+		using TreeType = orthtree::OrthTree<Body, Dim, TreePolicy>;
+
+	private:
+		using Node = typename TreeType::Node;
+		using Index = typename TreeType::Index;
+
+		static constexpr std::size_t task_count = 256;
+
+		struct Multipole : gravity::Moments<Scalar, Dim, 2> {
+			Scalar radius = 0;
+		};
+
+		struct Local {
+			Scalar pot = 0;
+			Vector grad;
+			Tensor hess;
+		};
+
+		TreeType tree_;
+		spatial::Box<Scalar, Dim> bbox_;
+		bool morton_build_;
+		Scalar max_escaped_;
+
+		std::vector<Multipole> multipoles_;
+		std::vector<Local> locals_;
+		std::vector<Index> tasks_;
+		std::vector<char> is_task_;
+
+		std::vector<Scalar> potentials_;
+
+		kernels::Isa isa_;
+		kernels::Particles<Scalar, Dim> particles_;
+
+		const Node& node(Index idx) const {
+			return tree_.nodes()[idx];
+		}
+
+		/* Largest distance from `center` to a corner of `box`. */
+		static Scalar box_radius(const spatial::Box<Scalar, Dim>& box, const Point& center) {
+			Scalar res = 0;
+			for (std::size_t d = 0; d < Dim; ++d) {
+				auto far = std::abs(center[d] - box.center[d]) + box.extent[d];
+				res += far*far;
+			}
+			return std::sqrt(res);
+		}
+
+		void upward(const std::vector<Body>& bodies, Index idx, bool stop_at_tasks) {
+			auto& n = node(idx);
+			auto& m = multipoles_[idx];
+			if (n.empty()) {
+				return;
+			}
+
+			m = Multipole {};
+
+			if (n.is_leaf()) {
+				// P2M
+				static_cast<gravity::Moments<Scalar, Dim, 2>&>(m) = kernels::p2m<2>(isa_, particles_, n.begin, n.end);
+				for (auto i : tree_.indices(n)) {
+					m.radius = std::max(m.radius, (bodies[i].pos - m.center).norm());
+				}
+				return;
+			}
+
+			// M2M
+			for (std::size_t c = 0; c < TreeType::fanout; ++c) {
+				Index child = n.first_child + c;
+				if (!(stop_at_tasks && is_task_[child])) {
+					upward(bodies, child, stop_at_tasks);
+				}
+				m.merge(multipoles_[child]);
+			}
+
+			for (std::size_t c = 0; c < TreeType::fanout; ++c) {
+				auto& cm = multipoles_[n.first_child + c];
+				if (cm.mass != 0) {
+					m.radius = std::max(m.radius, (cm.center - m.center).norm() + cm.radius);
+				}
+			}
+			m.radius = std::min(m.radius, box_radius(n.bbox, m.center));
+		}
+
+		void p2p(const std::vector<Body>& bodies, const Node& sink, const Node& source, std::span<Vector> acc, std::span<Scalar> pot) const {
+			stats::count(stats::Counter::PARTICLE_INTERACTIONS, sink.size()*source.size());
+			for (auto i : tree_.indices(sink)) {
+				auto [a, p] = kernels::p2p(isa_, particles_, source.begin, source.end, bodies[i].pos, bodies[i].mass, G, eps);
+				acc[i] += a;
+				pot[i] += p;
+			}
+		}
+
+		/* Adds the field of `m` to the local expansion `l` about `center`. */
+		void m2l(Local& l, const Point& center, const Multipole& m) const {
+			auto r = center - m.center;
+			gravity::KernelDerivatives<Scalar> k(r.norm_squared(), eps);
+
+			Scalar tr = 0;
+			Scalar rqr = 0;
+			Vector qr;
+			for (std::size_t a = 0; a < Dim; ++a) {
+				tr += m.quad(a, a);
+				for (std::size_t b = 0; b < Dim; ++b) {
+					qr[a] += m.quad(a, b) * r[b];
+				}
+				rqr += r[a] * qr[a];
+			}
+
+			l.pot += -G * (m.mass*k.h[0] + (k.h[1]*tr + k.h[2]*rqr)/2);
+			for (std::size_t a = 0; a < Dim; ++a) {
+				l.grad[a] += -G * (m.mass*r[a]*k.h[1] + (k.h[2]*(2*qr[a] + tr*r[a]) + k.h[3]*r[a]*rqr)/2);
+				for (std::size_t b = 0; b < Dim; ++b) {
+					l.hess(a, b) += -G * m.mass * ((a == b ? k.h[1] : 0) + r[a]*r[b]*k.h[2]);
+				}
+			}
+		}
+
+		void interact(const std::vector<Body>& bodies, Index a, Index b, std::span<Vector> acc, std::span<Scalar> pot) {
+			auto& na = node(a);
+			auto& nb = node(b);
+			if (na.empty() || nb.empty()) {
+				return;
+			}
+
+			if (a == b) {
+				if (na.is_leaf()) {
+					p2p(bodies, na, na, acc, pot);
+				} else {
+					stats::count(stats::Counter::NODES_OPENED);
+					for (std::size_t i = 0; i < TreeType::fanout; ++i) {
+						for (std::size_t j = 0; j < TreeType::fanout; ++j) {
+							interact(bodies, na.first_child + i, na.first_child + j, acc, pot);
+						}
+					}
+				}
+				return;
+			}
+
+			auto& ma = multipoles_[a];
+			auto& mb = multipoles_[b];
+			auto dist = (ma.center - mb.center).norm();
+
+			if (ma.radius + mb.radius < theta*dist) {
+				stats::count(stats::Counter::CELL_INTERACTIONS);
+				m2l(locals_[a], ma.center, mb);
+			} else if (na.is_leaf() && nb.is_leaf()) {
+				p2p(bodies, na, nb, acc, pot);
+			} else if (nb.is_leaf() || (!na.is_leaf() && ma.radius > mb.radius)) {
+				stats::count(stats::Counter::NODES_OPENED);
+				for (std::size_t i = 0; i < TreeType::fanout; ++i) {
+					interact(bodies, na.first_child + i, b, acc, pot);
+				}
+			} else {
+				stats::count(stats::Counter::NODES_OPENED);
+				for (std::size_t j = 0; j < TreeType::fanout; ++j) {
+					interact(bodies, a, nb.first_child + j, acc, pot);
+				}
+			}
+		}
+
+		/* Bodies outside of the tree walk it on their own, accepting nodes by the same criterion. */
+		void evaluate_outside(const std::vector<Body>& bodies, Index i, Index idx, std::span<Vector> acc, std::span<Scalar> pot) const {
+			auto& n = node(idx);
+			auto& m = multipoles_[idx];
+			if (n.empty()) {
+				return;
+			}
+
+			if (m.radius < theta*(bodies[i].pos - m.center).norm()) {
+				stats::count(stats::Counter::CELL_INTERACTIONS);
+				auto [a, p] = m.field(G, eps, bodies[i].pos, bodies[i].mass);
+				acc[i] += a;
+				pot[i] += p;
+			} else if (n.is_leaf()) {
+				stats::count(stats::Counter::NODES_OPENED);
+				stats::count(stats::Counter::PARTICLE_INTERACTIONS, n.size());
+				auto [a, p] = kernels::p2p(isa_, particles_, n.begin, n.end, bodies[i].pos, bodies[i].mass, G, eps);
+				acc[i] += a;
+				pot[i] += p;
+			} else {
+				stats::count(stats::Counter::NODES_OPENED);
+				for (auto&& child : tree_.children(n)) {
+					evaluate_outside(bodies, i, tree_.index(child), acc, pot);
+				}
+			}
+		}
+
+		void downward(const std::vector<Body>& bodies, Index idx, std::span<Vector> acc, std::span<Scalar> pot) {
+			auto& n = node(idx);
+			auto& l = locals_[idx];
+			if (n.empty()) {
+				return;
+			}
+
+			auto center = multipoles_[idx].center;
+
+			if (n.is_leaf()) {
+				// L2P
+				for (auto i : tree_.indices(n)) {
+					auto y = bodies[i].pos - center;
+					auto hy = l.hess * y;
+
+					Scalar phi = l.pot;
+					for (std::size_t d = 0; d < Dim; ++d) {
+						phi += l.grad[d]*y[d] + hy[d]*y[d]/2;
+						acc[i][d] -= l.grad[d] + hy[d];
+					}
+					pot[i] += bodies[i].mass * phi / 2;
+				}
+				return;
+			}
+
+			// L2L
+			for (auto&& child : tree_.children(n)) {
+				Index c = tree_.index(child);
+				if (child.empty()) {
+					continue;
+				}
+
+				auto& lc = locals_[c];
+				auto y = multipoles_[c].center - center;
+				auto hy = l.hess * y;
+
+				lc.pot += l.pot;
+				for (std::size_t a = 0; a < Dim; ++a) {
+					lc.pot += l.grad[a]*y[a] + hy[a]*y[a]/2;
+					lc.grad[a] += l.grad[a] + hy[a];
+					for (std::size_t b = 0; b < Dim; ++b) {
+						lc.hess(a, b) += l.hess(a, b);
+					}
+				}
+
+				downward(bodies, c, acc, pot);
+			}
+		}
+
+		/*
+		 * Evaluates the sink subtrees with at least one body for which
+		 * `active(i)` holds. Returns the potential energy of the evaluated
+		 * bodies.
+		 */
+		template<typename Active>
+		Scalar evaluate_where(const std::vector<Body>& bodies, std::span<Vector> acc, parallel::ThreadPool& pool, Active&& active) {
+			locals_.assign(tree_.nodes().size(), Local {});
+			potentials_.assign(bodies.size(), 0);
+
+			pool.for_chunks(tasks_.size(), [&](std::size_t t) {
+				auto indices = tree_.indices(node(tasks_[t]));
+				if (!std::ranges::any_of(indices, active)) {
+					return;
+				}
+
+				for (auto i : indices) {
+					acc[i] = Vector();
+				}
+				interact(bodies, tasks_[t], 0, acc, potentials_);
+				downward(bodies, tasks_[t], acc, potentials_);
+			});
+
+			auto outside = tree_.outside();
+			pool.for_each(outside.size(), [&](std::size_t begin, std::size_t end) {
+				for (std::size_t k = begin; k < end; ++k) {
+					if (active(outside[k])) {
+						acc[outside[k]] = Vector();
+						evaluate_outside(bodies, outside[k], 0, acc, potentials_);
+					}
+				}
+			});
+
+			return pool.reduce(bodies.size(), (Scalar)0., [this](std::size_t begin, std::size_t end) {
+				Scalar res = 0;
+				for (std::size_t i = begin; i < end; ++i) {
+					res += potentials_[i];
+				}
+				return res;
+			});
+		}
+
+		/* P2M and M2M of the whole tree, the task subtrees in parallel, then the top above them. */
+		void upward_pass(const std::vector<Body>& bodies, parallel::ThreadPool& pool) {
+			pool.for_chunks(tasks_.size(), [this, &bodies](std::size_t t) {
+				upward(bodies, tasks_[t], false);
+			});
+			if (!is_task_[0]) {
+				upward(bodies, 0, true);
+			}
+		}
+
+		/* Cuts the top of the tree into disjoint subtrees, expanding whole levels until there are enough. */
+		void select_tasks() {
+			tasks_.assign(1, 0);
+			while (tasks_.size() < task_count) {
+				std::vector<Index> next;
+				for (auto t : tasks_) {
+					auto& n = node(t);
+					if (n.is_leaf()) {
+						next.push_back(t);
+						continue;
+					}
+					for (auto&& child : tree_.children(n)) {
+						if (!child.empty()) {
+							next.push_back(tree_.index(child));
+						}
+					}
+				}
+				if (next == tasks_) {
+					break;
+				}
+				tasks_ = std::move(next);
+			}
+
+			is_task_.assign(tree_.nodes().size(), 0);
+			for (auto t : tasks_) {
+				is_task_[t] = 1;
+			}
+		}
+
+	public:
+		Scalar theta;
+		Scalar eps;
+		Scalar G;
+
+		Solver(config::Config cfg, const config::Units& units, const spatial::Box<Scalar, Dim>& bbox): tree_(tree_policy), bbox_(bbox) {
+			G = units.G();
+			theta = cfg.get_or_fail<Scalar>("simulation.engine.theta");
+			eps = cfg.get_or_fail<Scalar>("simulation.engine.eps");
+
+			tree_policy.node_capacity = cfg.get<std::size_t>("simulation.engine.leaf_capacity").value_or(tree_policy.node_capacity);
+
+			auto build = cfg.get<std::string>("simulation.engine.tree.build").value_or("morton");
+			if (build == "morton") {
+				morton_build_ = true;
+			} else if (build == "partition") {
+				morton_build_ = false;
+			} else {
+				config::backend_fail("tree build");
+			}
+
+			max_escaped_ = cfg.get<Scalar>("simulation.engine.tree.max_escaped").value_or(0.01);
+
+			isa_ = kernels::select<Scalar>(cfg);
+		}
+
+		/*
+		 * Rebuilds the tree and the multipole expansions. May reorder `bodies`,
+		 * returns the permutation applied to them (see
+		 * OrthTree::sort_elements()), empty if they kept their order.
+		 */
+		std::span<const Index> update(std::vector<Body>& bodies, parallel::ThreadPool& pool) {
+			std::span<const Index> permutation;
+			if (morton_build_) {
+				tree_.build_morton(bbox_, bodies, pool);
+				permutation = tree_.sort_elements(bodies);
+			} else {
+				tree_.build(bbox_, bodies);
+			}
+
+			particles_.assign(bodies, tree_.indices(tree_.root()), pool);
+
+			multipoles_.assign(tree_.nodes().size(), Multipole {});
+			select_tasks();
+			upward_pass(bodies, pool);
+
+			return permutation;
+		}
+
+		/*
+		 * Refits the node boxes to the moved bodies and recomputes the
+		 * multipole expansions, for the substeps of block timesteps. Rebuilds
+		 * like update() once too many bodies left their leaf cells.
+		 */
+		std::span<const Index> refit(std::vector<Body>& bodies, parallel::ThreadPool& pool) {
+			if (tree_.refit(bodies) > max_escaped_*bodies.size()) {
+				return update(bodies, pool);
+			}
+
+			particles_.assign(bodies, tree_.indices(tree_.root()), pool);
+			upward_pass(bodies, pool);
+			return {};
+		}
+
+		/* Writes accelerations of `bodies` to `acc` and returns the total potential energy. */
+		Scalar evaluate(const std::vector<Body>& bodies, std::span<Vector> acc, parallel::ThreadPool& pool) {
+			return evaluate_where(bodies, acc, pool, [](std::size_t) {
+				return true;
+			});
+		}
+
+		/*
+		 * Writes accelerations of bodies with `active[i]` set, others may be
+		 * left as they were or get updated too.
+		 */
+		void evaluate_active(const std::vector<Body>& bodies, std::span<const char> active, std::span<Vector> acc, parallel::ThreadPool& pool) {
+			evaluate_where(bodies, acc, pool, [active](std::size_t i) {
+				return active[i] != 0;
+			});
+		}
+
+		/* Changes the maximum number of bodies in a leaf, used from the next update(). */
+		void set_leaf_capacity(std::size_t capacity) {
+			tree_policy.node_capacity = capacity;
+		}
+
+		const TreeType& tree() const {
+			return tree_;
+		}
+	};
+}
+
+#endif
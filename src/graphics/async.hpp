@@ -0,0 +1,214 @@
+#ifndef GALAXY_GRAPHICS_ASYNC_H
+#define GALAXY_GRAPHICS_ASYNC_H
+
+#include <vector>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <future>
+#include <chrono>
+#include <exception>
+#include "../orthtree.hpp"
+#include "../spatial.hpp"
+#include "../config.hpp"
+#include "plots.hpp"
+
+
+namespace graphics {
+	/*
+	 * Runs `Graphics` on its own thread, so the physics never waits for
+	 * drawing, vsync or a camera being dragged around.
+	 *
+	 * show() only hands the newest state over: the bodies are copied into a
+	 * back buffer, which is swapped with the shared one under a lock. Steps
+	 * finished while the renderer has not taken the previous frame yet are
+	 * not copied at all. The renderer swaps the shared buffer with its front
+	 * buffer and draws it at `simulation.video.max_fps`, redrawing the last
+	 * frame when the physics is slower, so the window stays responsive.
+	 *
+	 * The window, the energy plot and all their library calls live on the
+	 * render thread. Energies of the sampled steps are queued for the plot.
+	 */
+	template<typename BodyType, typename Graphics>
+	class AsyncGraphics {
+	public:
+		static constexpr bool headless = false;
+		/* The energy plot is drawn by the render thread, not by the engine. */
+		static constexpr bool plots_energy = true;
+
+		using Body = BodyType;
+
+	private:
+		/* Stands in for the engine in Graphics::show(). */
+		struct Frame {
+			using Scalar = typename Body::Scalar;
+
+			std::vector<Body> bodies;
+			Scalar time = 0;
+		};
+
+		using FrameTree = orthtree::OrthTree<Body, Body::Dim, orthtree::OrthTreeItemPolicy<Body>>;
+
+		Frame back_;
+		Frame shared_;
+		Frame front_;
+
+		std::vector<std::pair<double, double>> energies_;
+
+		std::mutex mutex_;
+		std::condition_variable wake_;
+		bool fresh_ = false;
+		bool stop_ = false;
+
+		std::atomic<bool> taken_ = true;
+		std::atomic<bool> closed_ = false;
+		std::exception_ptr error_;
+
+		bool plot_energy_;
+		std::size_t plot_interval_;
+		std::chrono::duration<double> frame_interval_;
+
+		std::thread thread_;
+
+		void render(config::Config cfg, const config::Units& units, std::promise<void>& started) {
+			bool running = false;
+			try {
+				Graphics graphics(cfg, units);
+				plots::EnergyStatsPlot energy(cfg);
+
+				orthtree::OrthTreeItemPolicy<Body> tree_policy;
+				FrameTree tree(tree_policy);
+
+				std::array<typename Body::Scalar, Body::Dim> extent = config::get_coords_or_fail<typename Body::Scalar, Body::Dim>()(cfg, "simulation.size.extent");
+				spatial::Box<typename Body::Scalar, Body::Dim> bbox(spatial::Point<typename Body::Scalar, Body::Dim>(), extent);
+
+				started.set_value();
+				running = true;
+
+				std::vector<std::pair<double, double>> energies;
+				bool has_frame = false;
+				auto next_frame = std::chrono::steady_clock::now();
+
+				while (true) {
+					bool fresh;
+					{
+						std::unique_lock lock(mutex_);
+						wake_.wait_until(lock, next_frame, [this] { return stop_; });
+						if (stop_) {
+							break;
+						}
+
+						fresh = fresh_;
+						if (fresh) {
+							std::swap(shared_, front_);
+							fresh_ = false;
+							taken_ = true;
+						}
+						energies.swap(energies_);
+					}
+					next_frame = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(frame_interval_);
+
+					if (plot_energy_) {
+						for (auto [kin, pot] : energies) {
+							energy.log(kin, pot);
+						}
+						if (!energies.empty()) {
+							energy.show();
+						}
+					}
+					energies.clear();
+
+					if (fresh) {
+						has_frame = true;
+						if constexpr (Body::Dim == 2) {
+							tree.build(bbox, front_.bodies);
+						}
+					}
+					if (has_frame) {
+						graphics.show(front_.time, &front_, tree);
+					}
+
+					if (graphics.poll_close()) {
+						closed_ = true;
+					}
+				}
+			} catch (...) {
+				std::lock_guard lock(mutex_);
+				closed_ = true;
+				if (running) {
+					// Reported by poll_close()
+					error_ = std::current_exception();
+				} else {
+					started.set_exception(std::current_exception());
+				}
+			}
+		}
+
+	public:
+		AsyncGraphics(config::Config cfg, const config::Units& units) {
+			plot_energy_ = cfg.get<bool>("simulation.plots.energy.enable").value_or(true);
+			plot_interval_ = plots::EnergyStatsPlot::interval(cfg);
+			frame_interval_ = std::chrono::duration<double>(1. / cfg.get<double>("simulation.video.max_fps").value_or(30));
+
+			std::promise<void> started;
+			auto ready = started.get_future();
+			thread_ = std::thread([this, cfg, &units, &started] {
+				render(cfg, units, started);
+			});
+
+			try {
+				ready.get();
+			} catch (...) {
+				thread_.join();
+				throw;
+			}
+		}
+
+		AsyncGraphics(const AsyncGraphics&) = delete;
+		AsyncGraphics& operator=(const AsyncGraphics&) = delete;
+
+		~AsyncGraphics() {
+			{
+				std::lock_guard lock(mutex_);
+				stop_ = true;
+			}
+			wake_.notify_all();
+			thread_.join();
+		}
+
+		template<typename Engine, typename TreeType>
+		void show(typename Engine::Scalar time, const Engine* e, const TreeType& tree) {
+			if (plot_energy_ && e->steps() % plot_interval_ == 0) {
+				auto kin = e->kinetic_energy();
+				std::lock_guard lock(mutex_);
+				energies_.emplace_back(kin, e->potential_energy());
+			}
+
+			if (!taken_) {
+				return;
+			}
+
+			back_.bodies.assign(e->bodies.begin(), e->bodies.end());
+			back_.time = time;
+
+			std::lock_guard lock(mutex_);
+			std::swap(back_, shared_);
+			fresh_ = true;
+			taken_ = false;
+		}
+
+		bool poll_close() {
+			if (closed_) {
+				std::lock_guard lock(mutex_);
+				if (error_) {
+					std::rethrow_exception(std::exchange(error_, nullptr));
+				}
+			}
+			return closed_;
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef GALAXY_GRAPHICS_NULL_H
+#define GALAXY_GRAPHICS_NULL_H
+
+#include "../../config.hpp"
+
+
+namespace graphics {
+	/*
+	 * Graphics backend for runs without a display: opens no window, draws
+	 * nothing and never asks to close, so the simulation runs as fast as it can.
+	 */
+	class NullGraphics {
+	public:
+		static constexpr bool headless = true;
+
+		NullGraphics(config::Config cfg, const config::Units& units) {}
+
+		template<typename Engine, typename TreeType>
+		void show(typename Engine::Scalar time, const Engine* e, const TreeType& tree) {}
+
+		bool poll_close() {
+			return false;
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef GALAXY_PLOTS_IMPL_H
+#define GALAXY_PLOTS_IMPL_H
+
+#include <string>
+
+
+namespace plots {
+	struct Color {
+		unsigned char r, g, b;
+	};
+
+	inline Color color(unsigned char r, unsigned char g, unsigned char b) {
+		return Color { r, g, b };
+	}
+
+	/* Plots are not shown in builds without graphics. */
+	class PlotWindow {
+	public:
+		PlotWindow(std::size_t w, std::size_t h) {}
+
+		void set_name(const std::string& name) {}
+		void begin_plot() {}
+		void line(double start_x, double start_y, double end_x, double end_y, Color color) {}
+		void end_plot() {}
+	};
+}
+
+#endif
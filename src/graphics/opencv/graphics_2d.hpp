@@ -5,8 +5,14 @@
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
+#include <vector>
+#include <string>
+#include <cmath>
+#include <algorithm>
+
 #include "../../orthtree.hpp"
 #include "../../config.hpp"
+#include "../../parallel.hpp"
 #include "../../utils.hpp"
 #include "video.hpp"
 
@@ -26,52 +32,149 @@ namespace graphics {
 		bool use_video;
 		video::Writer writer;
 
+		/*
+		 * How bodies are drawn:
+		 *   CIRCLES - a circle per body and the boxes of the quadtree
+		 *   DENSITY - a mass density histogram, log tone-mapped and colored,
+		 *             stays readable for dense cores and large N
+		 */
+		enum class Render {
+			CIRCLES,
+			DENSITY,
+		} render;
+
+		int colormap;
+		parallel::ThreadPool pool;
+		std::vector<std::vector<float>> partial_density;
+		std::vector<float> density;
+		cv::Mat density_img;
+
 		template<typename TreePolicy>
-		void draw_quadtree_node(cv::Mat& img, const orthtree::TNode<typename TreePolicy::Item, 2, TreePolicy>* node) {
-			auto cx = node->bbox.center[0];
-			auto cy = node->bbox.center[1];
-			auto ex = node->bbox.extent[0];
-			auto ey = node->bbox.extent[1];
-
-			auto start_x = cx - ex + extent_x;
-			auto start_y = cy - ey + extent_y;
-			auto end_x = cx + ex + extent_x;
-			auto end_y = cy + ey + extent_y;
-
-			cv::rectangle(
-				img, 
-				cv::Point(start_x*scale_x(), start_y*scale_y()), 
-				cv::Point(end_x*scale_x(), end_y*scale_y()), 
-				cv::Scalar(100, 50, 50), 
-				1
-			);
+		void draw_quadtree(cv::Mat& img, const orthtree::QuadTree<typename TreePolicy::Item, TreePolicy>& qt) {
+			typename TreePolicy::GetPoint get_point;
+
+			for (auto&& node : qt.nodes()) {
+				auto cx = node.bbox.center[0];
+				auto cy = node.bbox.center[1];
+				auto ex = node.bbox.extent[0];
+				auto ey = node.bbox.extent[1];
+
+				auto start_x = cx - ex + extent_x;
+				auto start_y = cy - ey + extent_y;
+				auto end_x = cx + ex + extent_x;
+				auto end_y = cy + ey + extent_y;
+
+				cv::rectangle(
+					img, 
+					cv::Point(start_x*scale_x(), start_y*scale_y()), 
+					cv::Point(end_x*scale_x(), end_y*scale_y()), 
+					cv::Scalar(100, 50, 50), 
+					1
+				);
+
+				if (node.is_leaf()) {
+					for (auto&& value : qt.items(node)) {
+						auto point = get_point(value);
+
+						cv::circle(
+							img, 
+							cv::Point(
+								(point[0] + extent_x) * scale_x(), 
+								(point[1] + extent_y) * scale_y()
+							), 
+							point_size, 
+							cv::Scalar(255, 255, 255), 
+							-1
+						);
+					}
+				}
+			}
+		}
 
-			if (!node->is_leaf()) {
-				for (auto&& child : *(node->children)) {
-					draw_quadtree_node(img, child.get());
+		/*
+		 * Splats bodies into a density histogram of the image size with
+		 * cloud-in-cell weights. Every chunk of bodies fills its own histogram,
+		 * which are then summed row by row, so no atomics are needed.
+		 */
+		template<typename Body>
+		void draw_density(cv::Mat& img, const std::vector<Body>& bodies) {
+			int w = img.cols;
+			int h = img.rows;
+			std::size_t pixels = std::size_t(w)*h;
+
+			auto chunks = std::min(pool.size(), std::max<std::size_t>(1, bodies.size()/4096));
+			partial_density.resize(chunks);
+
+			auto sx = scale_x();
+			auto sy = scale_y();
+			pool.for_chunks(chunks, [&](std::size_t chunk) {
+				auto& hist = partial_density[chunk];
+				hist.assign(pixels, 0.f);
+
+				auto begin = bodies.size()*chunk/chunks;
+				auto end = bodies.size()*(chunk + 1)/chunks;
+				for (auto i = begin; i < end; ++i) {
+					// Pixel centers are at integer coordinates + 0.5
+					double x = (bodies[i].pos[0] + extent_x)*sx - 0.5;
+					double y = (bodies[i].pos[1] + extent_y)*sy - 0.5;
+					if (!(x > -1 && x < w && y > -1 && y < h)) {
+						continue;
+					}
+
+					int x0 = std::floor(x);
+					int y0 = std::floor(y);
+					float fx = x - x0;
+					float fy = y - y0;
+					float m = bodies[i].mass;
+
+					auto add = [&](int px, int py, float weight) {
+						if (px >= 0 && px < w && py >= 0 && py < h) {
+							hist[std::size_t(py)*w + px] += weight;
+						}
+					};
+					add(x0,     y0,     m*(1 - fx)*(1 - fy));
+					add(x0 + 1, y0,     m*fx*(1 - fy));
+					add(x0,     y0 + 1, m*(1 - fx)*fy);
+					add(x0 + 1, y0 + 1, m*fx*fy);
 				}
-			} else {
-				for (auto&& value : node->data) {
-					typename TreePolicy::GetPoint get_point;
-					auto point = get_point(value);
-
-					cv::circle(
-						img, 
-						cv::Point(
-							(point[0] + extent_x) * scale_x(), 
-							(point[1] + extent_y) * scale_y()
-						), 
-						point_size, 
-						cv::Scalar(255, 255, 255), 
-						-1
-					);
+			});
+
+			density.resize(pixels);
+			pool.for_each(std::size_t(h), [&](std::size_t begin, std::size_t end) {
+				for (auto p = begin*w; p < end*w; ++p) {
+					float sum = 0;
+					for (auto&& hist : partial_density) {
+						sum += hist[p];
+					}
+					density[p] = sum;
 				}
+			}, 16);
+
+			auto max_density = *std::max_element(density.begin(), density.end());
+			if (bodies.empty() || max_density <= 0) {
+				return;
 			}
-		}
 
-		template<typename TreePolicy>
-		void draw_quadtree(cv::Mat& img, const orthtree::QuadTree<typename TreePolicy::Item, TreePolicy>& qt) {
-			draw_quadtree_node(img, &qt.root());
+			// log(1 + d/m) maps one average body per pixel to about log(2)
+			double mean_mass = 0;
+			for (auto&& body : bodies) {
+				mean_mass += body.mass;
+			}
+			mean_mass /= bodies.size();
+
+			float norm = 255.f / std::log1p(max_density/mean_mass);
+			cv::Mat tone(h, w, CV_8UC1);
+			pool.for_each(std::size_t(h), [&](std::size_t begin, std::size_t end) {
+				for (auto y = begin; y < end; ++y) {
+					auto row = tone.ptr<unsigned char>(y);
+					for (int x = 0; x < w; ++x) {
+						row[x] = static_cast<unsigned char>(std::log1p(density[y*w + x]/mean_mass)*norm);
+					}
+				}
+			}, 16);
+
+			cv::applyColorMap(tone, density_img, colormap);
+			density_img.copyTo(img, tone);
 		}
 
 		template<typename Scalar>
@@ -112,6 +215,8 @@ namespace graphics {
 		}
 
 	public:
+		static constexpr bool headless = false;
+
 		double scale_x() {
 			return width/(extent_x*2.);
 		}
@@ -120,7 +225,7 @@ namespace graphics {
 			return height/(extent_y*2.);
 		}
 
-		Graphics2D(config::Config cfg, const config::Units& units): units(units) {
+		Graphics2D(config::Config cfg, const config::Units& units): units(units), pool(cfg.get<std::size_t>("simulation.video.threads").value_or(0)) {
 			extent_x = cfg.get_or_fail<double>("simulation.size.extent.x");
 			extent_y = cfg.get_or_fail<double>("simulation.size.extent.y");
 
@@ -135,6 +240,30 @@ namespace graphics {
 
 			point_size = cfg.get_or_fail<double>("simulation.video.point_size");
 
+			auto render_name = cfg.get<std::string>("simulation.video.render").value_or("circles");
+			if (render_name == "circles") {
+				render = Render::CIRCLES;
+			} else if (render_name == "density") {
+				render = Render::DENSITY;
+			} else {
+				config::backend_fail("render");
+			}
+
+			auto colormap_name = cfg.get<std::string>("simulation.video.colormap").value_or("inferno");
+			if (colormap_name == "inferno") {
+				colormap = cv::COLORMAP_INFERNO;
+			} else if (colormap_name == "magma") {
+				colormap = cv::COLORMAP_MAGMA;
+			} else if (colormap_name == "viridis") {
+				colormap = cv::COLORMAP_VIRIDIS;
+			} else if (colormap_name == "hot") {
+				colormap = cv::COLORMAP_HOT;
+			} else if (colormap_name == "bone") {
+				colormap = cv::COLORMAP_BONE;
+			} else {
+				config::backend_fail("colormap");
+			}
+
 			cv::namedWindow("galaxy", cv::WINDOW_NORMAL);
 		}
 
@@ -145,7 +274,11 @@ namespace graphics {
 		template<typename Engine, typename TreePolicy>
 		void show(typename TreePolicy::Item::Scalar time, const Engine* e, const orthtree::QuadTree<typename TreePolicy::Item, TreePolicy>& qt) {
 			cv::Mat img(height, width, CV_8UC3, cv::Scalar(0, 0, 0));
-			draw_quadtree(img, qt);
+			if (render == Render::DENSITY) {
+				draw_density(img, e->bodies);
+			} else {
+				draw_quadtree(img, qt);
+			}
 
 			draw_graphics(time, img);
 
@@ -67,6 +67,8 @@ namespace graphics {
 		}
 
 	public:
+		static constexpr bool headless = false;
+
 		Graphics3D(config::Config cfg, const config::Units& units): cfg(cfg), units(units), viz(cv::viz::Viz3d("galaxy")) {
 			extent_x = cfg.get_or_fail<double>("simulation.size.extent.x");
 			extent_y = cfg.get_or_fail<double>("simulation.size.extent.y");
@@ -2,52 +2,208 @@
 #define GALAXY_VIDEO_H
 
 #include <opencv2/videoio.hpp>
+#include <opencv2/imgcodecs.hpp>
 #include <unordered_set>
+#include <deque>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <iostream>
+#include <filesystem>
 #include "../../config.hpp"
 
 
 namespace video {
-	class Writer {
+	/*
+	 * Encodes frames on worker threads, fed through a bounded queue, so the
+	 * simulation only waits when the encoder falls more than `queue` frames
+	 * behind.
+	 *
+	 * Either encodes a video file through cv::VideoWriter on one thread
+	 * (codecs are sequential), or dumps every frame as an image
+	 * `<frames>_<index>.<format>` on a pool of threads, for encoding offline.
+	 */
+	class Encoder {
 	private:
+		struct Frame {
+			std::size_t index;
+			cv::Mat img;
+		};
+
 		cv::VideoWriter writer_;
+		std::string frames_;
+		std::string format_;
+
+		std::deque<Frame> queue_;
+		std::size_t max_queue_;
+		std::size_t next_index_ = 0;
+
+		std::mutex mutex_;
+		std::condition_variable changed_;
+		bool stop_ = false;
 
-		inline static std::unordered_set<Writer*> registry;
+		std::vector<std::thread> workers_;
+
+		std::string frame_path(std::size_t index) const {
+			auto num = std::to_string(index);
+			if (num.size() < 6) {
+				num.insert(0, 6 - num.size(), '0');
+			}
+			return frames_ + "_" + num + "." + format_;
+		}
+
+		void work() {
+			std::unique_lock lock(mutex_);
+			while (true) {
+				changed_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+				if (queue_.empty()) {
+					return;
+				}
+
+				auto frame = std::move(queue_.front());
+				queue_.pop_front();
+				changed_.notify_all();
+				lock.unlock();
+
+				if (frames_.empty()) {
+					writer_.write(frame.img);
+				} else if (!cv::imwrite(frame_path(frame.index), frame.img)) {
+					std::cout << "[video::Encoder] Error: Unable to write '" << frame_path(frame.index) << "'." << std::endl;
+				}
+
+				lock.lock();
+			}
+		}
 
 	public:
-		Writer() {};
-		Writer(config::Config cfg, std::size_t width, std::size_t height) {
-			auto filename = cfg.get_or_fail<std::string>("simulation.video.output.file");
-			auto fourcc = cfg.get<std::string>("simulation.video.output.fourcc").value_or("mp4v");
+		Encoder(config::Config cfg, std::size_t width, std::size_t height) {
+			max_queue_ = std::max<std::size_t>(1, cfg.get<std::size_t>("simulation.video.output.queue").value_or(16));
+
+			auto frames = cfg.get<std::string>("simulation.video.output.frames");
+			std::size_t threads = 1;
+
+			if (frames) {
+				frames_ = *frames;
+				format_ = cfg.get<std::string>("simulation.video.output.format").value_or("png");
+
+				auto dir = std::filesystem::path(frames_).parent_path();
+				if (!dir.empty()) {
+					std::filesystem::create_directories(dir);
+				}
+
+				threads = cfg.get<std::size_t>("simulation.video.output.threads").value_or(std::max(1u, std::thread::hardware_concurrency()/2));
+				threads = std::max<std::size_t>(1, threads);
+
+				std::cout << "[video::Encoder] Info: Writing frames '" << frame_path(0) << "', ...\n";
+			} else {
+				auto filename = cfg.get_or_fail<std::string>("simulation.video.output.file");
+				auto fourcc = cfg.get<std::string>("simulation.video.output.fourcc").value_or("mp4v");
 
-			if (fourcc.size() != 4) {
-				throw config::configuration_error("Invalid fourcc code.");
+				if (fourcc.size() != 4) {
+					throw config::configuration_error("Invalid fourcc code.");
+				}
+
+				auto fps = cfg.get_or_fail<double>("simulation.video.output.fps");
+
+				std::cout << "[video::Encoder] Info: Opening file '" << filename  << "'.\n";
+
+				writer_ = cv::VideoWriter(filename, cv::VideoWriter::fourcc(fourcc[0], fourcc[1], fourcc[2], fourcc[3]), fps, cv::Size(width, height));
 			}
 
-			auto fps = cfg.get_or_fail<double>("simulation.video.output.fps");
+			for (std::size_t i = 0; i < threads; ++i) {
+				workers_.emplace_back(&Encoder::work, this);
+			}
+		}
 
-			std::cout << "[video::Writer] Info: Opening file '" << filename  << "'.\n";
+		Encoder(const Encoder&) = delete;
+		Encoder& operator=(const Encoder&) = delete;
 
-			writer_ = cv::VideoWriter(filename, cv::VideoWriter::fourcc(fourcc[0], fourcc[1], fourcc[2], fourcc[3]), fps, cv::Size(width, height));
+		~Encoder() {
+			close();
+		}
 
-			registry.insert(this);
+		/* Queues `img`, which must not be modified afterwards (cv::Mat shares its data). */
+		void write(const cv::Mat& img) {
+			std::unique_lock lock(mutex_);
+			changed_.wait(lock, [this] { return stop_ || queue_.size() < max_queue_; });
+			if (stop_) {
+				return;
+			}
+			queue_.push_back(Frame { next_index_++, img });
+			changed_.notify_all();
+		}
+
+		/* Encodes the queued frames and finishes the file. */
+		void close() {
+			{
+				std::lock_guard lock(mutex_);
+				if (stop_) {
+					return;
+				}
+				stop_ = true;
+			}
+			changed_.notify_all();
+
+			for (auto&& w : workers_) {
+				w.join();
+			}
+			writer_.release();
+		}
+	};
+
+	class Writer {
+	private:
+		std::unique_ptr<Encoder> encoder_;
+
+		inline static std::mutex registry_mutex;
+		inline static std::unordered_set<Encoder*> registry;
+
+		void reset() {
+			if (encoder_) {
+				std::lock_guard lock(registry_mutex);
+				registry.erase(encoder_.get());
+			}
+			encoder_.reset();
+		}
+
+	public:
+		Writer() {};
+		Writer(config::Config cfg, std::size_t width, std::size_t height): encoder_(std::make_unique<Encoder>(cfg, width, height)) {
+			std::lock_guard lock(registry_mutex);
+			registry.insert(encoder_.get());
+		}
+
+		Writer(Writer&& other) = default;
+
+		Writer& operator=(Writer&& other) {
+			if (this != &other) {
+				reset();
+				encoder_ = std::move(other.encoder_);
+			}
+			return *this;
 		}
 
 		~Writer() {
-			registry.erase(this);
+			reset();
 		}
-		
+
 		void write(const cv::Mat& img) {
-			writer_.write(img);
+			encoder_->write(img);
 		}
 
+		/* Finishes all open videos, the frames still queued get encoded first. */
 		static void handle_exit() {
 			std::cout << "[video::Writer] Info: Closing open video writers.\n";
-			std::unordered_set<Writer*> registry_copy = registry;
-			for (auto&& w : registry_copy) {
-				w->~Writer();
+			std::lock_guard lock(registry_mutex);
+			for (auto&& e : registry) {
+				e->close();
 			}
 		}
 	};
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -2,9 +2,12 @@
 #define GALAXY_PLOTS_H
 
 #include <vector>
+#include <algorithm>
 #include "../config.hpp"
 
-#ifdef USE_OPENCV_GRAPHICS
+#if defined(USE_NULL_GRAPHICS)
+	#include "null/plots_impl.hpp"
+#elif defined(USE_OPENCV_GRAPHICS)
 	#include "opencv/plots_impl.hpp"
 #else
 	#include "raylib/plots_impl.hpp"
@@ -26,6 +29,11 @@ namespace plots {
 		virtual bool empty() = 0;
 		virtual double operator[](std::size_t idx) = 0;
 
+		/* Value the plot is relative to, drawn in the middle. */
+		virtual double base() {
+			return (*this)[0];
+		}
+
 		virtual ~LinearStatsPlot() {};
 
 		LinearStatsPlot(std::size_t plot_width, std::size_t plot_height): plot_height(plot_height), plot_width(plot_width), win(plot_width, plot_height) {};
@@ -40,7 +48,7 @@ namespace plots {
 
 			win.line(0, plot_height/2, plot_width, plot_height/2, plots::color(0, 255, 0));
 
-			auto base = (*this)[0];
+			auto base = this->base();
 			auto end = size();
 			auto start = end >= plot_width ? end-plot_width : 0;
 
@@ -56,35 +64,61 @@ namespace plots {
 		}
 	};
 
+	/*
+	 * Total energy relative to the first one. Only the last `size.width`
+	 * samples can be drawn, so only those are kept, in a ring buffer. A
+	 * sample is taken every `interval` steps.
+	 */
 	class EnergyStatsPlot : public LinearStatsPlot {
-		std::vector<double> kin_energy_;
-		std::vector<double> pot_energy_;
+		std::vector<double> energy_;
+		std::size_t count_ = 0;
+		double first_ = 0;
+		std::size_t interval_;
 
 	public:
 		EnergyStatsPlot(config::Config cfg): LinearStatsPlot(
 			cfg.get<double>("simulation.plots.energy.size.width").value_or(500.),
 			cfg.get<double>("simulation.plots.energy.size.height").value_or(200.)
-		) {}
+		) {
+			energy_.resize(std::max<std::size_t>(1, cfg.get<double>("simulation.plots.energy.size.width").value_or(500.)));
+			interval_ = interval(cfg);
+		}
+
+		static std::size_t interval(config::Config cfg) {
+			return std::max<std::size_t>(1, cfg.get<std::size_t>("simulation.plots.energy.interval").value_or(10));
+		}
 
 		virtual std::string name() override {
 			return "energy";
 		}
 
 		virtual std::size_t size() override {
-			return kin_energy_.size();
+			return std::min(count_, energy_.size());
 		}
 
 		virtual bool empty() override {
-			return kin_energy_.empty();
+			return count_ == 0;
 		}
 
 		virtual double operator[](std::size_t idx) override {
-			return kin_energy_[idx] + pot_energy_[idx];
+			return energy_[(count_ - size() + idx) % energy_.size()];
+		}
+
+		virtual double base() override {
+			return first_;
+		}
+
+		/* Whether step `step` is sampled. */
+		bool due(std::size_t step) const {
+			return step % interval_ == 0;
 		}
 
 		virtual void log(double kin, double pot) {
-			kin_energy_.push_back(kin);
-			pot_energy_.push_back(pot);
+			if (count_ == 0) {
+				first_ = kin + pot;
+			}
+			energy_[count_ % energy_.size()] = kin + pot;
+			++count_;
 		}
 	};
 }
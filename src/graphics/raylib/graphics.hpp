@@ -6,6 +6,7 @@ namespace raylib {
 	extern "C" {
 		#include <raylib.h>
 		#include <rcamera.h>
+		#include <rlgl.h>
 	}
 
 	static constexpr raylib::Color White = raylib::Color{255, 255, 255, 255};
@@ -25,48 +25,42 @@ namespace graphics {
 		video::Writer writer;*/
 
 		template<typename TreePolicy>
-		void draw_quadtree_node(const orthtree::TNode<typename TreePolicy::Item, 2, TreePolicy>* node) {
-			float cx = node->bbox.center[0];
-			float cy = node->bbox.center[1];
-			float ex = node->bbox.extent[0];
-			float ey = node->bbox.extent[1];
-
-			float start_x = cx - ex + extent_x;
-			float start_y = cy - ey + extent_y;
-
-			raylib::DrawRectangleLinesEx(
-				raylib::Rectangle {
-					start_x*scale_x(), start_y*scale_y(),
-					ex*2*scale_x(), ey*2*scale_y()
-				},
-				0.5,
-				raylib::Color{50, 50, 100, 255}
-			);
-
-			if (!node->is_leaf()) {
-				for (auto&& child : *(node->children)) {
-					draw_quadtree_node(child.get());
-				}
-			} else {
-				for (auto&& value : node->data) {
-					typename TreePolicy::GetPoint get_point;
-					auto point = get_point(value);
-
-					raylib::DrawCircle(
-						(point[0] + extent_x) * scale_x(),
-						(point[1] + extent_y) * scale_y(),
-						point_size/2.f,
-						raylib::White
-					);
+		void draw_quadtree(const orthtree::QuadTree<typename TreePolicy::Item, TreePolicy>& qt) {
+			typename TreePolicy::GetPoint get_point;
+
+			for (auto&& node : qt.nodes()) {
+				float cx = node.bbox.center[0];
+				float cy = node.bbox.center[1];
+				float ex = node.bbox.extent[0];
+				float ey = node.bbox.extent[1];
+
+				float start_x = cx - ex + extent_x;
+				float start_y = cy - ey + extent_y;
+
+				raylib::DrawRectangleLinesEx(
+					raylib::Rectangle {
+						start_x*scale_x(), start_y*scale_y(),
+						ex*2*scale_x(), ey*2*scale_y()
+					},
+					0.5,
+					raylib::Color{50, 50, 100, 255}
+				);
+
+				if (node.is_leaf()) {
+					for (auto&& value : qt.items(node)) {
+						auto point = get_point(value);
+
+						raylib::DrawCircle(
+							(point[0] + extent_x) * scale_x(),
+							(point[1] + extent_y) * scale_y(),
+							point_size/2.f,
+							raylib::White
+						);
+					}
 				}
 			}
 		}
 
-		template<typename TreePolicy>
-		void draw_quadtree(const orthtree::QuadTree<typename TreePolicy::Item, TreePolicy>& qt) {
-			draw_quadtree_node(&qt.root());
-		}
-
 		template<typename Scalar>
 		void draw_graphics(Scalar time) {
 			/* Draw timestamp */
@@ -96,6 +90,8 @@ namespace graphics {
 		}
 
 	public:
+		static constexpr bool headless = false;
+
 		float scale_x() {
 			return width/(extent_x*2.);
 		}
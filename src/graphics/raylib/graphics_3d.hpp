@@ -1,6 +1,11 @@
 #ifndef GALAXY_GRAPHICS_3D_H
 #define GALAXY_GRAPHICS_3D_H
 
+#include <vector>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include <iostream>
 #include "graphics.hpp"
 #include "../../orthtree.hpp"
 #include "../../config.hpp"
@@ -19,6 +24,25 @@ namespace graphics {
 		float point_size;
 		bool show_bbox;
 
+		/*
+		 * How bodies are drawn:
+		 *   POINTS  - one vertex buffer of positions, updated once per frame and
+		 *             drawn by a single call as 1px points
+		 *   SPRITES - camera facing quads of `point_size`, batched by rlgl into a
+		 *             few draw calls, also fine for software GL
+		 *   SPHERES - a tessellated sphere per body, for small simulations only
+		 */
+		enum class Render {
+			POINTS,
+			SPRITES,
+			SPHERES,
+		} render;
+
+		std::vector<float> vertices;
+		raylib::Mesh points_mesh = { 0 };
+		raylib::Material points_material;
+		int points_capacity = 0;
+
 		const config::Units& units;
 
 		raylib::Camera camera;
@@ -39,13 +63,19 @@ namespace graphics {
 				raylib::BeginMode3D(camera);
 					raylib::DrawCubeWires(raylib::Vector3{0, 0, 0}, extent_x*2/far_divisor, extent_y*2/far_divisor, extent_z*2/far_divisor, raylib::White);
 
-					for (auto&& body : e->bodies) {
-						auto center = raylib::Vector3{
-							static_cast<float>(body.pos[0])/far_divisor, 
-							static_cast<float>(body.pos[1])/far_divisor, 
-							static_cast<float>(body.pos[2])/far_divisor
-						};
-						DrawSphere(center, point_size/10.f/far_divisor, raylib::White);
+					if (render == Render::POINTS) {
+						draw_points(e->bodies);
+					} else if (render == Render::SPRITES) {
+						draw_sprites(e->bodies);
+					} else {
+						for (auto&& body : e->bodies) {
+							auto center = raylib::Vector3{
+								static_cast<float>(body.pos[0])/far_divisor, 
+								static_cast<float>(body.pos[1])/far_divisor, 
+								static_cast<float>(body.pos[2])/far_divisor
+							};
+							DrawSphere(center, point_size/10.f/far_divisor, raylib::White);
+						}
 					}
 
 				raylib::EndMode3D();
@@ -58,6 +88,97 @@ namespace graphics {
 			}*/
 		}
 
+		/*
+		 * Uploads positions to a dynamic vertex buffer and draws its vertices
+		 * as points (point polygon mode, the buffer is padded to whole triangles).
+		 * The buffer only gets reallocated when the body count outgrows it.
+		 */
+		template<typename Body>
+		void draw_points(const std::vector<Body>& bodies) {
+			if (bodies.empty()) {
+				return;
+			}
+
+			int count = (bodies.size() + 2)/3*3;
+			vertices.resize(count*3);
+			for (std::size_t i = 0; i < std::size_t(count); ++i) {
+				auto& pos = bodies[std::min(i, bodies.size() - 1)].pos;
+				for (std::size_t d = 0; d < 3; ++d) {
+					vertices[i*3 + d] = static_cast<float>(pos[d])/far_divisor;
+				}
+			}
+
+			if (count > points_capacity) {
+				if (points_capacity > 0) {
+					raylib::UnloadMesh(points_mesh);
+				} else {
+					points_material = raylib::LoadMaterialDefault();
+				}
+				points_capacity = std::max(count, points_capacity*2);
+				vertices.resize(points_capacity*3);
+
+				points_mesh = { 0 };
+				points_mesh.vertexCount = points_capacity;
+				points_mesh.triangleCount = points_capacity/3;
+				points_mesh.vertices = vertices.data();
+				raylib::UploadMesh(&points_mesh, true);
+				// The vertices are ours, UnloadMesh() must not free them
+				points_mesh.vertices = nullptr;
+			} else {
+				raylib::UpdateMeshBuffer(points_mesh, 0, vertices.data(), count*3*sizeof(float), 0);
+			}
+
+			points_mesh.vertexCount = count;
+			points_mesh.triangleCount = count/3;
+
+			raylib::Matrix identity = { 0 };
+			identity.m0 = identity.m5 = identity.m10 = identity.m15 = 1.f;
+
+			raylib::rlEnablePointMode();
+			raylib::DrawMesh(points_mesh, points_material, identity);
+			raylib::rlDisablePointMode();
+		}
+
+		/* Draws bodies as quads facing the camera, in chunks fitting the rlgl batch. */
+		template<typename Body>
+		void draw_sprites(const std::vector<Body>& bodies) {
+			auto sub = [](raylib::Vector3 a, raylib::Vector3 b) {
+				return raylib::Vector3{ a.x - b.x, a.y - b.y, a.z - b.z };
+			};
+			auto cross = [](raylib::Vector3 a, raylib::Vector3 b) {
+				return raylib::Vector3{ a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x };
+			};
+			auto scaled = [](raylib::Vector3 a, float len) {
+				auto norm = std::sqrt(a.x*a.x + a.y*a.y + a.z*a.z);
+				return raylib::Vector3{ a.x*len/norm, a.y*len/norm, a.z*len/norm };
+			};
+
+			auto half = point_size/10.f/far_divisor;
+			auto forward = sub(camera.target, camera.position);
+			auto right = scaled(cross(forward, camera.up), half);
+			auto up = scaled(cross(right, forward), half);
+
+			static constexpr std::size_t chunk = 1024;
+			for (std::size_t begin = 0; begin < bodies.size(); begin += chunk) {
+				auto end = std::min(bodies.size(), begin + chunk);
+				raylib::rlCheckRenderBatchLimit(4*(end - begin));
+
+				raylib::rlBegin(RL_QUADS);
+				raylib::rlColor4ub(255, 255, 255, 255);
+				for (std::size_t i = begin; i < end; ++i) {
+					float x = static_cast<float>(bodies[i].pos[0])/far_divisor;
+					float y = static_cast<float>(bodies[i].pos[1])/far_divisor;
+					float z = static_cast<float>(bodies[i].pos[2])/far_divisor;
+
+					raylib::rlVertex3f(x - right.x - up.x, y - right.y - up.y, z - right.z - up.z);
+					raylib::rlVertex3f(x + right.x - up.x, y + right.y - up.y, z + right.z - up.z);
+					raylib::rlVertex3f(x + right.x + up.x, y + right.y + up.y, z + right.z + up.z);
+					raylib::rlVertex3f(x - right.x + up.x, y - right.y + up.y, z - right.z + up.z);
+				}
+				raylib::rlEnd();
+			}
+		}
+
 		bool btn_pressed() {
 			return raylib::IsMouseButtonDown(raylib::MOUSE_BUTTON_LEFT) || \
 				raylib::IsMouseButtonPressed(raylib::MOUSE_BUTTON_LEFT) || \
@@ -96,6 +217,8 @@ namespace graphics {
 		}
 
 	public:
+		static constexpr bool headless = false;
+
 		float scale_x() {
 			return width/(extent_x*2.);
 		}
@@ -124,10 +247,27 @@ namespace graphics {
 
 			point_size = cfg.get_or_fail<float>("simulation.video.point_size");
 
+			auto render_name = cfg.get<std::string>("simulation.video.render").value_or("sprites");
+			if (render_name == "points") {
+				render = Render::POINTS;
+			} else if (render_name == "sprites") {
+				render = Render::SPRITES;
+			} else if (render_name == "spheres") {
+				render = Render::SPHERES;
+			} else {
+				config::backend_fail("render");
+			}
+
 			win_context = raylib::InitWindowPro(width, height, "galaxy", raylib::FLAG_WINDOW_RESIZABLE);
 			raylib::SetActiveWindowContext(win_context);
 			raylib::SetTargetFPS(max_fps);
 
+			auto gl = raylib::rlGetVersion();
+			if (render == Render::POINTS && (gl == raylib::RL_OPENGL_11 || gl == raylib::RL_OPENGL_ES_20)) {
+				std::cout << "[graphics::Graphics3D] Info: Points need vertex buffers and point polygon mode, drawing sprites instead." << std::endl;
+				render = Render::SPRITES;
+			}
+
 			camera = { 0 };
 			camera.position = raylib::Vector3 { 0.0f, 0.0f, -4*std::max(std::max(extent_x, extent_y), extent_z)/far_divisor };
 			camera.target = raylib::Vector3 { 0.0f, 0.0f, 0.0f };
@@ -138,6 +278,10 @@ namespace graphics {
 
 		~Graphics3D() {
 			raylib::SetActiveWindowContext(win_context);
+			if (points_capacity > 0) {
+				raylib::UnloadMesh(points_mesh);
+				raylib::UnloadMaterial(points_material);
+			}
 			raylib::CloseWindow();
 		}
 
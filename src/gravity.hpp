@@ -0,0 +1,207 @@
+#ifndef GALAXY_GRAVITY_H
+#define GALAXY_GRAVITY_H
+
+#include <cmath>
+#include <utility>
+#include <array>
+#include <type_traits>
+#include "spatial.hpp"
+
+
+namespace gravity {
+	/*
+	 * Plummer-softened interaction of a body at `pos` with a point mass
+	 * `other_mass` at `other_pos`. Returns the acceleration of the body and
+	 * half of the pair potential energy (every pair is visited from both sides).
+	 */
+	template<typename Scalar, spatial::Dimension D>
+	inline std::pair<spatial::Vector<Scalar, D>, Scalar> interact(
+		Scalar G, Scalar eps,
+		const spatial::Point<Scalar, D>& pos, Scalar mass,
+		const spatial::Point<Scalar, D>& other_pos, Scalar other_mass
+	) {
+		auto diff = pos - other_pos;
+
+		auto inv = 1/std::sqrt(diff.norm_squared() + eps*eps);
+
+		auto acc = -G * other_mass * inv*inv*inv * diff;
+		auto pot = -G * mass * other_mass * inv / 2;
+
+		return std::make_pair(acc, pot);
+	}
+
+	/*
+	 * Derivatives of the softened kernel f(x) = 1/sqrt(|x|^2 + eps^2).
+	 *
+	 * The kernel depends on x only through u = |x|^2, so every derivative
+	 * tensor is a sum of products of x and Kronecker deltas weighted by
+	 * h[n] = 2^n d^n/du^n f, e.g.
+	 *   d_i f       = x_i h[1]
+	 *   d_i d_j f   = delta_ij h[1] + x_i x_j h[2]
+	 *   d_i d_j d_k f = (delta_ij x_k + delta_ik x_j + delta_jk x_i) h[2] + x_i x_j x_k h[3]
+	 */
+	template<typename Scalar>
+	struct KernelDerivatives {
+		std::array<Scalar, 5> h;
+
+		KernelDerivatives(Scalar dist_squared, Scalar eps) {
+			auto s = 1/std::sqrt(dist_squared + eps*eps);
+			auto s2 = s*s;
+
+			h[0] = s;
+			h[1] = -s*s2;
+			h[2] = -3*h[1]*s2;
+			h[3] = -5*h[2]*s2;
+			h[4] = -7*h[3]*s2;
+		}
+	};
+
+	struct NoMoment {};
+
+	/*
+	 * Multipole moments of a set of point masses about their center of mass,
+	 * up to `Order` (1 = monopole, the dipole vanishes about the center of
+	 * mass, 2 = quadrupole, 3 = octupole). Moments of higher orders than
+	 * `Order` take no space.
+	 *
+	 * Moments are kept central and merged with the parallel axis theorem, so
+	 * they stay accurate far away from the origin.
+	 */
+	template<typename Scalar, spatial::Dimension D, std::size_t Order>
+	struct Moments {
+		static_assert(Order >= 1 && Order <= 3, "Supported multipole orders are 1, 2 and 3.");
+
+		using Point = spatial::Point<Scalar, D>;
+		using Vector = spatial::Vector<Scalar, D>;
+		using Tensor2 = spatial::Matrix<Scalar, D, D>;
+		using Tensor3 = std::array<Tensor2, D>;
+
+		static constexpr std::size_t order = Order;
+
+		Scalar mass = 0;
+		Point center;
+
+		/* Q_ij = sum m y_i y_j */
+		[[no_unique_address]] std::conditional_t<Order >= 2, Tensor2, NoMoment> quad {};
+		/* O_ijk = sum m y_i y_j y_k, stored as oct[i](j, k) */
+		[[no_unique_address]] std::conditional_t<Order >= 3, Tensor3, NoMoment> oct {};
+
+		void add(const Point& pos, Scalar m) {
+			Moments other;
+			other.mass = m;
+			other.center = pos;
+			merge(other);
+		}
+
+		void merge(const Moments& other) {
+			if (other.mass == 0) {
+				return;
+			}
+			if (mass == 0) {
+				*this = other;
+				return;
+			}
+
+			auto total = mass + other.mass;
+			auto c = center + (other.mass/total) * (other.center - center);
+
+			auto d1 = center - c;
+			auto d2 = other.center - c;
+
+			if constexpr (Order >= 3) {
+				// Uses the quadrupoles before they get shifted.
+				shift_oct(oct, quad, mass, d1);
+				auto other_oct = other.oct;
+				shift_oct(other_oct, other.quad, other.mass, d2);
+				for (std::size_t i = 0; i < D; ++i) {
+					for (std::size_t j = 0; j < D; ++j) {
+						for (std::size_t k = 0; k < D; ++k) {
+							oct[i](j, k) += other_oct[i](j, k);
+						}
+					}
+				}
+			}
+			if constexpr (Order >= 2) {
+				for (std::size_t i = 0; i < D; ++i) {
+					for (std::size_t j = 0; j < D; ++j) {
+						quad(i, j) += other.quad(i, j) + mass*d1[i]*d1[j] + other.mass*d2[i]*d2[j];
+					}
+				}
+			}
+
+			mass = total;
+			center = c;
+		}
+
+		/*
+		 * Field of the moments at `pos` felt by a body of mass `body_mass`,
+		 * same conventions as interact().
+		 */
+		std::pair<Vector, Scalar> field(Scalar G, Scalar eps, const Point& pos, Scalar body_mass) const {
+			auto r = pos - center;
+			KernelDerivatives<Scalar> k(r.norm_squared(), eps);
+
+			Vector res = mass*k.h[1] * r;
+			Scalar phi = mass*k.h[0];
+
+			if constexpr (Order >= 2) {
+				Scalar tr = 0;
+				Scalar rqr = 0;
+				Vector qr;
+				for (std::size_t i = 0; i < D; ++i) {
+					tr += quad(i, i);
+					for (std::size_t j = 0; j < D; ++j) {
+						qr[i] += quad(i, j) * r[j];
+					}
+					rqr += r[i] * qr[i];
+				}
+
+				phi += (k.h[1]*tr + k.h[2]*rqr)/2;
+				for (std::size_t i = 0; i < D; ++i) {
+					res[i] += (k.h[2]*(2*qr[i] + tr*r[i]) + k.h[3]*r[i]*rqr)/2;
+				}
+			}
+
+			if constexpr (Order >= 3) {
+				// t_i = O_ikk, orr_i = O_ijk r_j r_k
+				Vector t;
+				Vector orr;
+				for (std::size_t i = 0; i < D; ++i) {
+					for (std::size_t j = 0; j < D; ++j) {
+						t[i] += oct[i](j, j);
+						for (std::size_t l = 0; l < D; ++l) {
+							orr[i] += oct[i](j, l) * r[j] * r[l];
+						}
+					}
+				}
+				Scalar tr = 0;
+				Scalar orrr = 0;
+				for (std::size_t i = 0; i < D; ++i) {
+					tr += t[i] * r[i];
+					orrr += orr[i] * r[i];
+				}
+
+				phi -= (3*k.h[2]*tr + k.h[3]*orrr)/6;
+				for (std::size_t i = 0; i < D; ++i) {
+					res[i] -= (3*k.h[2]*t[i] + 3*k.h[3]*(orr[i] + r[i]*tr) + k.h[4]*r[i]*orrr)/6;
+				}
+			}
+
+			return std::make_pair(G * res, -G * body_mass * phi / 2);
+		}
+
+	private:
+		/* Moves the octupole of moments (`mass`, `quad`) by `d`, the dipole is zero. */
+		static void shift_oct(Tensor3& oct, const Tensor2& quad, Scalar mass, const Vector& d) {
+			for (std::size_t i = 0; i < D; ++i) {
+				for (std::size_t j = 0; j < D; ++j) {
+					for (std::size_t k = 0; k < D; ++k) {
+						oct[i](j, k) += quad(i, j)*d[k] + quad(i, k)*d[j] + quad(j, k)*d[i] + mass*d[i]*d[j]*d[k];
+					}
+				}
+			}
+		}
+	};
+}
+
+#endif
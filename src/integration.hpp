@@ -1,39 +1,261 @@
 #ifndef GALAXY_INTEGRATION_H
 #define GALAXY_INTEGRATION_H
-#include <functional>
+#include <vector>
+#include <variant>
+#include <string>
+#include <span>
+#include <cmath>
+#include <algorithm>
 #include "config.hpp"
+#include "parallel.hpp"
 
 
 namespace integration {
+	/* Bodies per chunk of the passes, they are memory bound. */
+	static constexpr std::size_t grain = 4096;
+
 	template<typename Body>
-	using IntegrationMethod = std::function<void(Body&, double, const typename Body::Vector&)>;
+	void kick(std::vector<Body>& bodies, const std::vector<typename Body::Vector>& acc, typename Body::Scalar h, parallel::ThreadPool& pool) {
+		pool.for_each(bodies.size(), [&](std::size_t begin, std::size_t end) {
+			for (std::size_t i = begin; i < end; ++i) {
+				bodies[i].vel += acc[i] * h;
+			}
+		}, grain);
+	}
 
+	/* Kick by `h`, then drift by `dt`, in one pass. */
 	template<typename Body>
-	void euler(Body& body, typename Body::Scalar dt, const typename Body::Vector& acc) {
-		body.vel += acc * dt;
-		body.pos += body.vel * dt;
+	void kick_drift(std::vector<Body>& bodies, const std::vector<typename Body::Vector>& acc, typename Body::Scalar h, typename Body::Scalar dt, parallel::ThreadPool& pool) {
+		pool.for_each(bodies.size(), [&](std::size_t begin, std::size_t end) {
+			for (std::size_t i = begin; i < end; ++i) {
+				bodies[i].vel += acc[i] * h;
+				bodies[i].pos += bodies[i].vel * dt;
+			}
+		}, grain);
+	}
+
+	/* Reorders `values` by a permutation returned from a solver update, see OrthTree::sort_elements(). */
+	template<typename T, typename Index>
+	void permute(std::vector<T>& values, std::span<const Index> permutation) {
+		if (values.size() != permutation.size()) {
+			return;
+		}
+
+		std::vector<T> res;
+		res.reserve(values.size());
+		for (auto i : permutation) {
+			res.push_back(values[i]);
+		}
+		values.swap(res);
 	}
 
+	/*
+	 * Largest distance of the positions of `bodies` from `other`, relative to
+	 * the distance they moved from `start`, but at least `length`. All three
+	 * in the same order. The error estimate of adaptive steps.
+	 */
 	template<typename Body>
-	void leapfrog(Body& body, typename Body::Scalar dt, const typename Body::Vector& acc) {
-		auto nextvel = body.vel + acc*dt*(typename Body::Scalar)0.5;
-		body.pos += nextvel*dt*(typename Body::Scalar)0.5;
-		body.vel = nextvel;
+	typename Body::Scalar position_error(const std::vector<Body>& bodies, const std::vector<typename Body::Point>& other, const std::vector<typename Body::Point>& start, typename Body::Scalar length, parallel::ThreadPool& pool) {
+		using Scalar = typename Body::Scalar;
+
+		/* Partial results are reduced by their maximum. */
+		struct MaxError {
+			Scalar value = 0;
+
+			void operator+=(const MaxError& e) {
+				value = std::max(value, e.value);
+			}
+		};
+
+		return pool.reduce(bodies.size(), MaxError {}, [&](std::size_t begin, std::size_t end) {
+			MaxError res;
+			for (std::size_t i = begin; i < end; ++i) {
+				auto moved = std::max((bodies[i].pos - start[i]).norm(), length);
+				res += MaxError {(bodies[i].pos - other[i]).norm() / moved};
+			}
+			return res;
+		}, grain).value;
 	}
 
+	/*
+	 * Integrators advance all bodies by one step in whole-array passes over
+	 * `bodies`, their accelerations `acc` and, for methods with `needs_jerk`,
+	 * their jerks `jerk`. `forces()` recomputes `acc` (and `jerk`) for the
+	 * current positions. It may reorder the bodies together with `acc` and
+	 * `jerk`, and returns the permutation (empty if there was none).
+	 *
+	 * `evaluates_forces` tells whether the step leaves `acc` valid for the
+	 * new positions. Otherwise the caller computes them before every step.
+	 *
+	 * `error_order` is the power of dt in the relative error of positions
+	 * after a step, which adaptive steps estimate (see position_error()).
+	 */
+
+	/* Semi-implicit Euler: kick by the accelerations at the start of the step, then drift. */
+	struct Euler {
+		static constexpr bool evaluates_forces = false;
+		static constexpr bool needs_jerk = false;
+		static constexpr int error_order = 1;
+
+		template<typename Body, typename Forces>
+		void step(std::vector<Body>& bodies, std::vector<typename Body::Vector>& acc, std::vector<typename Body::Vector>&, typename Body::Scalar dt, parallel::ThreadPool& pool, Forces&&) {
+			kick_drift(bodies, acc, dt, dt, pool);
+		}
+	};
+
+	/*
+	 * Kick-drift-kick leapfrog: half kick by the accelerations from the end of
+	 * the previous step, drift, new accelerations, half kick. Velocities stay
+	 * synchronized with the positions between steps.
+	 */
+	struct Leapfrog {
+		static constexpr bool evaluates_forces = true;
+		static constexpr bool needs_jerk = false;
+		static constexpr int error_order = 2;
+
+		template<typename Body, typename Forces>
+		void step(std::vector<Body>& bodies, std::vector<typename Body::Vector>& acc, std::vector<typename Body::Vector>&, typename Body::Scalar dt, parallel::ThreadPool& pool, Forces&& forces) {
+			kick_drift(bodies, acc, dt/2, dt, pool);
+			forces();
+			kick(bodies, acc, dt/2, pool);
+		}
+	};
+
+	/*
+	 * Fourth order symplectic integrator of Forest-Ruth and Yoshida: three
+	 * kick-drift-kick leapfrog steps of w1 dt, w0 dt and w1 dt, the middle
+	 * one backwards in time. Adjacent kicks are merged, a step costs three
+	 * force evaluations.
+	 */
+	struct Yoshida4 {
+		static constexpr bool evaluates_forces = true;
+		static constexpr bool needs_jerk = false;
+		static constexpr int error_order = 4;
+
+		static inline const double w1 = 1 / (2 - std::cbrt(2.));
+		static inline const double w0 = -std::cbrt(2.) / (2 - std::cbrt(2.));
+
+		template<typename Body, typename Forces>
+		void step(std::vector<Body>& bodies, std::vector<typename Body::Vector>& acc, std::vector<typename Body::Vector>&, typename Body::Scalar dt, parallel::ThreadPool& pool, Forces&& forces) {
+			kick_drift(bodies, acc, w1*dt/2, w1*dt, pool);
+			forces();
+			kick_drift(bodies, acc, (w1 + w0)*dt/2, w0*dt, pool);
+			forces();
+			kick_drift(bodies, acc, (w0 + w1)*dt/2, w1*dt, pool);
+			forces();
+			kick(bodies, acc, w1*dt/2, pool);
+		}
+	};
+
+	/*
+	 * Fourth order Hermite predictor-corrector. Positions and velocities are
+	 * predicted by a Taylor expansion with the acceleration and jerk at the
+	 * start of the step, then corrected with the acceleration and jerk at the
+	 * predicted positions, which are kept for the next step.
+	 *
+	 * The difference of the corrected positions from the predicted ones
+	 * estimates the error of the step, see error().
+	 *
+	 * Jerks come from the solver. The direct engine sums them exactly, the
+	 * tree engine takes accepted nodes as monopoles moving with their center
+	 * of mass (also with higher `order`), so their error grows with theta.
+	 */
+	template<typename Body>
+	struct Hermite {
+		static constexpr bool evaluates_forces = true;
+		static constexpr bool needs_jerk = true;
+		/* The predictor is third order in positions. */
+		static constexpr int error_order = 3;
+
+		using Vector = typename Body::Vector;
+
+		/* State at the start of the step, follows reordered bodies. */
+		std::vector<typename Body::Point> pos0;
+		std::vector<Vector> vel0;
+		std::vector<Vector> acc0;
+		std::vector<Vector> jerk0;
+		/* Predicted positions of the last step. */
+		std::vector<typename Body::Point> predicted;
+
+		template<typename Forces>
+		void step(std::vector<Body>& bodies, std::vector<Vector>& acc, std::vector<Vector>& jerk, typename Body::Scalar dt, parallel::ThreadPool& pool, Forces&& forces) {
+			auto n = bodies.size();
+			pos0.resize(n);
+			vel0.resize(n);
+			acc0.assign(acc.begin(), acc.end());
+			jerk0.assign(jerk.begin(), jerk.end());
+
+			pool.for_each(n, [&](std::size_t begin, std::size_t end) {
+				for (std::size_t i = begin; i < end; ++i) {
+					auto& b = bodies[i];
+					pos0[i] = b.pos;
+					vel0[i] = b.vel;
+					b.pos += b.vel*dt + acc[i]*(dt*dt/2) + jerk[i]*(dt*dt*dt/6);
+					b.vel += acc[i]*dt + jerk[i]*(dt*dt/2);
+				}
+			}, grain);
+
+			auto permutation = forces();
+			if (!permutation.empty()) {
+				permute(pos0, permutation);
+				permute(vel0, permutation);
+				permute(acc0, permutation);
+				permute(jerk0, permutation);
+			}
+
+			predicted.resize(n);
+			pool.for_each(n, [&](std::size_t begin, std::size_t end) {
+				for (std::size_t i = begin; i < end; ++i) {
+					auto& b = bodies[i];
+					predicted[i] = b.pos;
+					b.vel = vel0[i] + (acc0[i] + acc[i])*(dt/2) + (jerk0[i] - jerk[i])*(dt*dt/12);
+					b.pos = pos0[i] + (vel0[i] + b.vel)*(dt/2) + (acc0[i] - acc[i])*(dt*dt/12);
+				}
+			}, grain);
+		}
+
+		/* Error of the last step, the corrections of positions relative to the distance moved (at least `length`). */
+		typename Body::Scalar error(const std::vector<Body>& bodies, typename Body::Scalar length, parallel::ThreadPool& pool) const {
+			return position_error(bodies, predicted, pos0, length, pool);
+		}
+	};
+
+	/* Selected once at startup, steps are dispatched by std::visit. */
 	template<typename Body>
-	IntegrationMethod<Body> get(config::Config icfg) {
+	using Method = std::variant<Euler, Leapfrog, Yoshida4, Hermite<Body>>;
+
+	template<typename Body>
+	Method<Body> get(config::Config icfg) {
 		auto name = icfg.get_or_fail<std::string>("type");
 
 		if (name == "euler") {
-			return euler<Body>;
+			return Euler {};
 		} else if (name == "leapfrog") {
-			return leapfrog<Body>;
+			return Leapfrog {};
+		} else if (name == "yoshida4" || name == "forest_ruth") {
+			return Yoshida4 {};
+		} else if (name == "hermite") {
+			return Hermite<Body> {};
 		} else {
 			config::backend_fail("integration");
 			return {};
 		}
 	}
+
+	/* Whether steps of `method` leave the accelerations valid, see Euler and Leapfrog. */
+	template<typename Body>
+	bool evaluates_forces(const Method<Body>& method) {
+		return std::visit([](const auto& m) {
+			return m.evaluates_forces;
+		}, method);
+	}
+
+	template<typename Body>
+	bool needs_jerk(const Method<Body>& method) {
+		return std::visit([](const auto& m) {
+			return m.needs_jerk;
+		}, method);
+	}
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,740 @@
+#ifndef GALAXY_KERNELS_H
+#define GALAXY_KERNELS_H
+
+#include <vector>
+#include <array>
+#include <span>
+#include <cmath>
+#include <cstdint>
+#include <new>
+#include <string>
+#include <utility>
+#include <type_traits>
+#include <algorithm>
+
+#include "spatial.hpp"
+#include "gravity.hpp"
+#include "parallel.hpp"
+#include "config.hpp"
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+	#define GALAXY_X86_SIMD
+	#include <immintrin.h>
+#endif
+
+
+namespace kernels {
+	template<typename T, std::size_t Align>
+	struct AlignedAllocator {
+		using value_type = T;
+
+		template<typename U>
+		struct rebind {
+			using other = AlignedAllocator<U, Align>;
+		};
+
+		AlignedAllocator() = default;
+
+		template<typename U>
+		AlignedAllocator(const AlignedAllocator<U, Align>&) {}
+
+		T* allocate(std::size_t n) {
+			return static_cast<T*>(::operator new(n*sizeof(T), std::align_val_t(Align)));
+		}
+
+		void deallocate(T* ptr, std::size_t) {
+			::operator delete(ptr, std::align_val_t(Align));
+		}
+
+		template<typename U>
+		bool operator==(const AlignedAllocator<U, Align>&) const {
+			return true;
+		}
+	};
+
+	/* Cache line, also the width of an AVX-512 register. */
+	static constexpr std::size_t alignment = 64;
+	/* Lanes of the widest kernel, a full vector load starting at any element stays in bounds. */
+	static constexpr std::size_t padding = 8;
+
+	template<typename T>
+	using AlignedVector = std::vector<T, AlignedAllocator<T, alignment>>;
+
+	/*
+	 * Positions and masses of bodies in structure-of-arrays layout, stored in
+	 * tree order so that the bodies of every node are a contiguous range.
+	 * Arrays are aligned and padded with massless entries.
+	 */
+	template<typename Scalar, spatial::Dimension D>
+	struct Particles {
+		std::array<AlignedVector<Scalar>, D> pos;
+		AlignedVector<Scalar> mass;
+
+		std::size_t size() const {
+			return size_;
+		}
+
+		void clear() {
+			size_ = 0;
+		}
+
+		/* Resizes to `n` particles, new ones are uninitialized. */
+		void resize(std::size_t n) {
+			size_ = n;
+			if (mass.size() < n + padding) {
+				auto capacity = std::max(n + padding, 2*mass.size());
+				for (auto&& p : pos) {
+					p.resize(capacity, 0);
+				}
+				mass.resize(capacity, 0);
+			}
+		}
+
+		void push_back(const spatial::Point<Scalar, D>& pt, Scalar m) {
+			auto k = size_;
+			resize(k + 1);
+			for (std::size_t d = 0; d < D; ++d) {
+				pos[d][k] = pt[d];
+			}
+			mass[k] = m;
+		}
+
+		/* Appends particles [begin, end) of `other`. */
+		void append(const Particles& other, std::size_t begin, std::size_t end) {
+			auto k = size_;
+			resize(k + end - begin);
+			for (std::size_t d = 0; d < D; ++d) {
+				std::copy(other.pos[d].begin() + begin, other.pos[d].begin() + end, pos[d].begin() + k);
+			}
+			std::copy(other.mass.begin() + begin, other.mass.begin() + end, mass.begin() + k);
+		}
+
+		/* Gathers `bodies[order[k]]` into slot k. */
+		template<typename Body, typename Index>
+		void assign(const std::vector<Body>& bodies, std::span<const Index> order, parallel::ThreadPool& pool) {
+			size_ = order.size();
+			for (auto&& p : pos) {
+				p.assign(size_ + padding, 0);
+			}
+			mass.assign(size_ + padding, 0);
+
+			pool.for_each(size_, [&](std::size_t begin, std::size_t end) {
+				for (std::size_t k = begin; k < end; ++k) {
+					auto& body = bodies[order[k]];
+					for (std::size_t d = 0; d < D; ++d) {
+						pos[d][k] = body.pos[d];
+					}
+					mass[k] = body.mass;
+				}
+			}, 4096);
+		}
+
+	private:
+		std::size_t size_ = 0;
+	};
+
+	/*
+	 * Field at the particles of a Particles set, in the same layout: sums of
+	 * m/r^3 * (x_other - x) in `acc` and of m/r in `pot`, without G.
+	 */
+	template<typename Scalar, spatial::Dimension D>
+	struct Field {
+		std::array<AlignedVector<Scalar>, D> acc;
+		AlignedVector<Scalar> pot;
+
+		/* Zeroes the field of `n` particles. */
+		void reset(std::size_t n) {
+			for (auto&& a : acc) {
+				a.assign(n + padding, 0);
+			}
+			pot.assign(n + padding, 0);
+		}
+	};
+
+	enum class Isa {
+		scalar,
+		avx2,
+		avx512
+	};
+
+	inline const char* isa_name(Isa isa) {
+		switch (isa) {
+			case Isa::avx2: return "avx2";
+			case Isa::avx512: return "avx512";
+			default: return "scalar";
+		}
+	}
+
+	inline bool supported(Isa isa) {
+		#ifdef GALAXY_X86_SIMD
+			switch (isa) {
+				case Isa::avx2: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+				case Isa::avx512: return __builtin_cpu_supports("avx512f");
+				default: return true;
+			}
+		#else
+			return isa == Isa::scalar;
+		#endif
+	}
+
+	/*
+	 * Kernel set from `simulation.engine.simd`: "auto" (default) picks the
+	 * widest one the CPU supports, "scalar", "avx2" and "avx512" force one.
+	 * Only double precision has vector kernels.
+	 */
+	template<typename Scalar>
+	Isa select(config::Config cfg) {
+		auto name = cfg.get<std::string>("simulation.engine.simd").value_or("auto");
+
+		Isa isa;
+		if (name == "auto") {
+			isa = Isa::scalar;
+			if constexpr (std::is_same_v<Scalar, double>) {
+				for (auto candidate : {Isa::avx2, Isa::avx512}) {
+					if (supported(candidate)) {
+						isa = candidate;
+					}
+				}
+			}
+		} else if (name == "scalar") {
+			isa = Isa::scalar;
+		} else if (name == "avx2" && std::is_same_v<Scalar, double> && supported(Isa::avx2)) {
+			isa = Isa::avx2;
+		} else if (name == "avx512" && std::is_same_v<Scalar, double> && supported(Isa::avx512)) {
+			isa = Isa::avx512;
+		} else {
+			config::backend_fail("simd");
+		}
+
+		return isa;
+	}
+
+	/* Sums of a leaf needed for its multipole expansion, `second` about `center`. */
+	template<typename Scalar, spatial::Dimension D>
+	struct LeafSums {
+		Scalar mass = 0;
+		std::array<Scalar, D> center {};
+		std::array<Scalar, D*D> second {};
+	};
+
+	template<typename Scalar, spatial::Dimension D>
+	std::pair<std::array<Scalar, D>, Scalar> p2p_scalar(const Particles<Scalar, D>& p, std::size_t begin, std::size_t end, const spatial::Point<Scalar, D>& pos, Scalar eps) {
+		std::array<Scalar, D> acc {};
+		Scalar pot = 0;
+
+		for (std::size_t i = begin; i < end; ++i) {
+			std::array<Scalar, D> diff;
+			Scalar r2 = eps*eps;
+			for (std::size_t d = 0; d < D; ++d) {
+				diff[d] = p.pos[d][i] - pos[d];
+				r2 += diff[d]*diff[d];
+			}
+
+			auto inv = 1/std::sqrt(r2);
+			auto m_inv = p.mass[i]*inv;
+			pot += m_inv;
+
+			auto f = m_inv*inv*inv;
+			for (std::size_t d = 0; d < D; ++d) {
+				acc[d] += f*diff[d];
+			}
+		}
+
+		return std::make_pair(acc, pot);
+	}
+
+	template<typename Scalar, spatial::Dimension D>
+	void p2p_pairs_scalar(const Particles<Scalar, D>& p, Field<Scalar, D>& field, std::size_t a_begin, std::size_t a_end, std::size_t b_begin, std::size_t b_end, Scalar eps) {
+		for (std::size_t i = a_begin; i < a_end; ++i) {
+			std::array<Scalar, D> acc {};
+			Scalar pot = 0;
+
+			for (std::size_t j = a_begin == b_begin ? i + 1 : b_begin; j < b_end; ++j) {
+				std::array<Scalar, D> diff;
+				Scalar r2 = eps*eps;
+				for (std::size_t d = 0; d < D; ++d) {
+					diff[d] = p.pos[d][j] - p.pos[d][i];
+					r2 += diff[d]*diff[d];
+				}
+
+				auto inv = 1/std::sqrt(r2);
+				auto inv3 = inv*inv*inv;
+				pot += p.mass[j]*inv;
+				field.pot[j] += p.mass[i]*inv;
+				for (std::size_t d = 0; d < D; ++d) {
+					acc[d] += p.mass[j]*inv3*diff[d];
+					field.acc[d][j] -= p.mass[i]*inv3*diff[d];
+				}
+			}
+
+			for (std::size_t d = 0; d < D; ++d) {
+				field.acc[d][i] += acc[d];
+			}
+			field.pot[i] += pot;
+		}
+	}
+
+	template<typename Scalar, spatial::Dimension D>
+	LeafSums<Scalar, D> p2m_scalar(const Particles<Scalar, D>& p, std::size_t begin, std::size_t end) {
+		LeafSums<Scalar, D> res;
+
+		for (std::size_t i = begin; i < end; ++i) {
+			res.mass += p.mass[i];
+			for (std::size_t d = 0; d < D; ++d) {
+				res.center[d] += p.mass[i]*p.pos[d][i];
+			}
+		}
+		for (std::size_t d = 0; d < D; ++d) {
+			res.center[d] /= res.mass;
+		}
+
+		for (std::size_t i = begin; i < end; ++i) {
+			for (std::size_t a = 0; a < D; ++a) {
+				auto ma = p.mass[i]*(p.pos[a][i] - res.center[a]);
+				for (std::size_t b = a; b < D; ++b) {
+					res.second[a*D + b] += ma*(p.pos[b][i] - res.center[b]);
+				}
+			}
+		}
+
+		return res;
+	}
+
+	#ifdef GALAXY_X86_SIMD
+		[[gnu::target("avx2,fma")]]
+		inline double hsum(__m256d v) {
+			auto lo = _mm256_castpd256_pd128(v);
+			auto hi = _mm256_extractf128_pd(v, 1);
+			lo = _mm_add_pd(lo, hi);
+			return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+		}
+
+		/* All ones in the first `n` lanes. */
+		[[gnu::target("avx2,fma")]]
+		inline __m256d tail_mask(std::size_t n) {
+			auto lanes = _mm256_set_epi64x(3, 2, 1, 0);
+			return _mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_set1_epi64x(n), lanes));
+		}
+
+		template<spatial::Dimension D>
+		[[gnu::target("avx2,fma")]]
+		std::pair<std::array<double, D>, double> p2p_avx2(const Particles<double, D>& p, std::size_t begin, std::size_t end, const spatial::Point<double, D>& pos, double eps) {
+			__m256d x[D], acc[D];
+			for (std::size_t d = 0; d < D; ++d) {
+				x[d] = _mm256_set1_pd(pos[d]);
+				acc[d] = _mm256_setzero_pd();
+			}
+			auto pot = _mm256_setzero_pd();
+			auto eps2 = _mm256_set1_pd(eps*eps);
+			auto one = _mm256_set1_pd(1.);
+
+			for (std::size_t i = begin; i < end; i += 4) {
+				__m256d diff[D];
+				auto r2 = eps2;
+				for (std::size_t d = 0; d < D; ++d) {
+					diff[d] = _mm256_sub_pd(_mm256_loadu_pd(&p.pos[d][i]), x[d]);
+					r2 = _mm256_fmadd_pd(diff[d], diff[d], r2);
+				}
+				auto m = _mm256_loadu_pd(&p.mass[i]);
+
+				if (i + 4 > end) {
+					// Lanes past the range hold other bodies or padding.
+					auto mask = tail_mask(end - i);
+					m = _mm256_and_pd(m, mask);
+					r2 = _mm256_blendv_pd(one, r2, mask);
+				}
+
+				auto inv = _mm256_div_pd(one, _mm256_sqrt_pd(r2));
+				auto m_inv = _mm256_mul_pd(m, inv);
+				pot = _mm256_add_pd(pot, m_inv);
+
+				auto f = _mm256_mul_pd(m_inv, _mm256_mul_pd(inv, inv));
+				for (std::size_t d = 0; d < D; ++d) {
+					acc[d] = _mm256_fmadd_pd(f, diff[d], acc[d]);
+				}
+			}
+
+			std::array<double, D> res;
+			for (std::size_t d = 0; d < D; ++d) {
+				res[d] = hsum(acc[d]);
+			}
+			return std::make_pair(res, hsum(pot));
+		}
+
+		template<spatial::Dimension D>
+		[[gnu::target("avx2,fma")]]
+		LeafSums<double, D> p2m_avx2(const Particles<double, D>& p, std::size_t begin, std::size_t end) {
+			LeafSums<double, D> res;
+
+			auto mass = _mm256_setzero_pd();
+			__m256d first[D];
+			for (std::size_t d = 0; d < D; ++d) {
+				first[d] = _mm256_setzero_pd();
+			}
+			for (std::size_t i = begin; i < end; i += 4) {
+				auto m = _mm256_loadu_pd(&p.mass[i]);
+				if (i + 4 > end) {
+					m = _mm256_and_pd(m, tail_mask(end - i));
+				}
+				mass = _mm256_add_pd(mass, m);
+				for (std::size_t d = 0; d < D; ++d) {
+					first[d] = _mm256_fmadd_pd(m, _mm256_loadu_pd(&p.pos[d][i]), first[d]);
+				}
+			}
+			res.mass = hsum(mass);
+
+			__m256d c[D], second[D*D];
+			for (std::size_t d = 0; d < D; ++d) {
+				res.center[d] = hsum(first[d]) / res.mass;
+				c[d] = _mm256_set1_pd(res.center[d]);
+			}
+			for (std::size_t k = 0; k < D*D; ++k) {
+				second[k] = _mm256_setzero_pd();
+			}
+
+			for (std::size_t i = begin; i < end; i += 4) {
+				auto m = _mm256_loadu_pd(&p.mass[i]);
+				if (i + 4 > end) {
+					m = _mm256_and_pd(m, tail_mask(end - i));
+				}
+
+				__m256d y[D];
+				for (std::size_t d = 0; d < D; ++d) {
+					y[d] = _mm256_sub_pd(_mm256_loadu_pd(&p.pos[d][i]), c[d]);
+				}
+				for (std::size_t a = 0; a < D; ++a) {
+					auto ma = _mm256_mul_pd(m, y[a]);
+					for (std::size_t b = a; b < D; ++b) {
+						second[a*D + b] = _mm256_fmadd_pd(ma, y[b], second[a*D + b]);
+					}
+				}
+			}
+			for (std::size_t a = 0; a < D; ++a) {
+				for (std::size_t b = a; b < D; ++b) {
+					res.second[a*D + b] = hsum(second[a*D + b]);
+				}
+			}
+
+			return res;
+		}
+
+		template<spatial::Dimension D>
+		[[gnu::target("avx2,fma")]]
+		void p2p_pairs_avx2(const Particles<double, D>& p, Field<double, D>& field, std::size_t a_begin, std::size_t a_end, std::size_t b_begin, std::size_t b_end, double eps) {
+			auto eps2 = _mm256_set1_pd(eps*eps);
+			auto one = _mm256_set1_pd(1.);
+
+			for (std::size_t i = a_begin; i < a_end; ++i) {
+				__m256d x[D], acc[D];
+				for (std::size_t d = 0; d < D; ++d) {
+					x[d] = _mm256_set1_pd(p.pos[d][i]);
+					acc[d] = _mm256_setzero_pd();
+				}
+				auto pot = _mm256_setzero_pd();
+				auto m_i = _mm256_set1_pd(p.mass[i]);
+
+				auto begin = a_begin == b_begin ? i + 1 : b_begin;
+				for (std::size_t j = begin; j < b_end; j += 4) {
+					auto mask = tail_mask(std::min<std::size_t>(4, b_end - j));
+					auto store_mask = _mm256_castpd_si256(mask);
+
+					__m256d diff[D];
+					auto r2 = eps2;
+					for (std::size_t d = 0; d < D; ++d) {
+						diff[d] = _mm256_sub_pd(_mm256_loadu_pd(&p.pos[d][j]), x[d]);
+						r2 = _mm256_fmadd_pd(diff[d], diff[d], r2);
+					}
+					// Lanes past the range belong to other bodies, they get no field.
+					auto m_j = _mm256_and_pd(_mm256_loadu_pd(&p.mass[j]), mask);
+					auto m_i_masked = _mm256_and_pd(m_i, mask);
+					r2 = _mm256_blendv_pd(one, r2, mask);
+
+					auto inv = _mm256_div_pd(one, _mm256_sqrt_pd(r2));
+					auto inv3 = _mm256_mul_pd(inv, _mm256_mul_pd(inv, inv));
+					pot = _mm256_fmadd_pd(m_j, inv, pot);
+
+					auto pot_j = _mm256_fmadd_pd(m_i_masked, inv, _mm256_loadu_pd(&field.pot[j]));
+					_mm256_maskstore_pd(&field.pot[j], store_mask, pot_j);
+
+					auto f_i = _mm256_mul_pd(m_j, inv3);
+					auto f_j = _mm256_mul_pd(m_i_masked, inv3);
+					for (std::size_t d = 0; d < D; ++d) {
+						acc[d] = _mm256_fmadd_pd(f_i, diff[d], acc[d]);
+						auto acc_j = _mm256_fnmadd_pd(f_j, diff[d], _mm256_loadu_pd(&field.acc[d][j]));
+						_mm256_maskstore_pd(&field.acc[d][j], store_mask, acc_j);
+					}
+				}
+
+				for (std::size_t d = 0; d < D; ++d) {
+					field.acc[d][i] += hsum(acc[d]);
+				}
+				field.pot[i] += hsum(pot);
+			}
+		}
+
+		// GCC 12 warns about the deliberately undefined registers inside its AVX-512 intrinsics.
+		#pragma GCC diagnostic push
+		#pragma GCC diagnostic ignored "-Wuninitialized"
+		#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+		template<spatial::Dimension D>
+		[[gnu::target("avx512f")]]
+		std::pair<std::array<double, D>, double> p2p_avx512(const Particles<double, D>& p, std::size_t begin, std::size_t end, const spatial::Point<double, D>& pos, double eps) {
+			__m512d x[D], acc[D];
+			for (std::size_t d = 0; d < D; ++d) {
+				x[d] = _mm512_set1_pd(pos[d]);
+				acc[d] = _mm512_setzero_pd();
+			}
+			auto pot = _mm512_setzero_pd();
+			auto eps2 = _mm512_set1_pd(eps*eps);
+			auto one = _mm512_set1_pd(1.);
+
+			for (std::size_t i = begin; i < end; i += 8) {
+				__mmask8 mask = i + 8 > end ? (1u << (end - i)) - 1 : 0xff;
+
+				__m512d diff[D];
+				auto r2 = eps2;
+				for (std::size_t d = 0; d < D; ++d) {
+					diff[d] = _mm512_sub_pd(_mm512_loadu_pd(&p.pos[d][i]), x[d]);
+					r2 = _mm512_fmadd_pd(diff[d], diff[d], r2);
+				}
+				auto m = _mm512_maskz_loadu_pd(mask, &p.mass[i]);
+				r2 = _mm512_mask_blend_pd(mask, one, r2);
+
+				auto inv = _mm512_div_pd(one, _mm512_sqrt_pd(r2));
+				auto m_inv = _mm512_mul_pd(m, inv);
+				pot = _mm512_add_pd(pot, m_inv);
+
+				auto f = _mm512_mul_pd(m_inv, _mm512_mul_pd(inv, inv));
+				for (std::size_t d = 0; d < D; ++d) {
+					acc[d] = _mm512_fmadd_pd(f, diff[d], acc[d]);
+				}
+			}
+
+			std::array<double, D> res;
+			for (std::size_t d = 0; d < D; ++d) {
+				res[d] = _mm512_reduce_add_pd(acc[d]);
+			}
+			return std::make_pair(res, _mm512_reduce_add_pd(pot));
+		}
+
+		template<spatial::Dimension D>
+		[[gnu::target("avx512f")]]
+		LeafSums<double, D> p2m_avx512(const Particles<double, D>& p, std::size_t begin, std::size_t end) {
+			LeafSums<double, D> res;
+
+			auto mass = _mm512_setzero_pd();
+			__m512d first[D];
+			for (std::size_t d = 0; d < D; ++d) {
+				first[d] = _mm512_setzero_pd();
+			}
+			for (std::size_t i = begin; i < end; i += 8) {
+				__mmask8 mask = i + 8 > end ? (1u << (end - i)) - 1 : 0xff;
+				auto m = _mm512_maskz_loadu_pd(mask, &p.mass[i]);
+				mass = _mm512_add_pd(mass, m);
+				for (std::size_t d = 0; d < D; ++d) {
+					first[d] = _mm512_fmadd_pd(m, _mm512_loadu_pd(&p.pos[d][i]), first[d]);
+				}
+			}
+			res.mass = _mm512_reduce_add_pd(mass);
+
+			__m512d c[D], second[D*D];
+			for (std::size_t d = 0; d < D; ++d) {
+				res.center[d] = _mm512_reduce_add_pd(first[d]) / res.mass;
+				c[d] = _mm512_set1_pd(res.center[d]);
+			}
+			for (std::size_t k = 0; k < D*D; ++k) {
+				second[k] = _mm512_setzero_pd();
+			}
+
+			for (std::size_t i = begin; i < end; i += 8) {
+				__mmask8 mask = i + 8 > end ? (1u << (end - i)) - 1 : 0xff;
+				auto m = _mm512_maskz_loadu_pd(mask, &p.mass[i]);
+
+				__m512d y[D];
+				for (std::size_t d = 0; d < D; ++d) {
+					y[d] = _mm512_sub_pd(_mm512_loadu_pd(&p.pos[d][i]), c[d]);
+				}
+				for (std::size_t a = 0; a < D; ++a) {
+					auto ma = _mm512_mul_pd(m, y[a]);
+					for (std::size_t b = a; b < D; ++b) {
+						second[a*D + b] = _mm512_fmadd_pd(ma, y[b], second[a*D + b]);
+					}
+				}
+			}
+			for (std::size_t a = 0; a < D; ++a) {
+				for (std::size_t b = a; b < D; ++b) {
+					res.second[a*D + b] = _mm512_reduce_add_pd(second[a*D + b]);
+				}
+			}
+
+			return res;
+		}
+
+		template<spatial::Dimension D>
+		[[gnu::target("avx512f")]]
+		void p2p_pairs_avx512(const Particles<double, D>& p, Field<double, D>& field, std::size_t a_begin, std::size_t a_end, std::size_t b_begin, std::size_t b_end, double eps) {
+			auto eps2 = _mm512_set1_pd(eps*eps);
+			auto one = _mm512_set1_pd(1.);
+
+			for (std::size_t i = a_begin; i < a_end; ++i) {
+				__m512d x[D], acc[D];
+				for (std::size_t d = 0; d < D; ++d) {
+					x[d] = _mm512_set1_pd(p.pos[d][i]);
+					acc[d] = _mm512_setzero_pd();
+				}
+				auto pot = _mm512_setzero_pd();
+
+				auto begin = a_begin == b_begin ? i + 1 : b_begin;
+				for (std::size_t j = begin; j < b_end; j += 8) {
+					// Lanes past the range belong to other bodies, they get no field.
+					__mmask8 mask = j + 8 > b_end ? (1u << (b_end - j)) - 1 : 0xff;
+
+					__m512d diff[D];
+					auto r2 = eps2;
+					for (std::size_t d = 0; d < D; ++d) {
+						diff[d] = _mm512_sub_pd(_mm512_loadu_pd(&p.pos[d][j]), x[d]);
+						r2 = _mm512_fmadd_pd(diff[d], diff[d], r2);
+					}
+					auto m_j = _mm512_maskz_loadu_pd(mask, &p.mass[j]);
+					auto m_i = _mm512_maskz_mov_pd(mask, _mm512_set1_pd(p.mass[i]));
+					r2 = _mm512_mask_blend_pd(mask, one, r2);
+
+					auto inv = _mm512_div_pd(one, _mm512_sqrt_pd(r2));
+					auto inv3 = _mm512_mul_pd(inv, _mm512_mul_pd(inv, inv));
+					pot = _mm512_fmadd_pd(m_j, inv, pot);
+
+					auto pot_j = _mm512_fmadd_pd(m_i, inv, _mm512_loadu_pd(&field.pot[j]));
+					_mm512_mask_storeu_pd(&field.pot[j], mask, pot_j);
+
+					auto f_i = _mm512_mul_pd(m_j, inv3);
+					auto f_j = _mm512_mul_pd(m_i, inv3);
+					for (std::size_t d = 0; d < D; ++d) {
+						acc[d] = _mm512_fmadd_pd(f_i, diff[d], acc[d]);
+						auto acc_j = _mm512_fnmadd_pd(f_j, diff[d], _mm512_loadu_pd(&field.acc[d][j]));
+						_mm512_mask_storeu_pd(&field.acc[d][j], mask, acc_j);
+					}
+				}
+
+				for (std::size_t d = 0; d < D; ++d) {
+					field.acc[d][i] += _mm512_reduce_add_pd(acc[d]);
+				}
+				field.pot[i] += _mm512_reduce_add_pd(pot);
+			}
+		}
+
+		#pragma GCC diagnostic pop
+	#endif
+
+	/*
+	 * Field of the particles [begin, end) at `pos` felt by a body of mass
+	 * `mass`, same conventions as gravity::interact().
+	 */
+	template<typename Scalar, spatial::Dimension D>
+	std::pair<spatial::Vector<Scalar, D>, Scalar> p2p(
+		Isa isa, const Particles<Scalar, D>& p, std::size_t begin, std::size_t end,
+		const spatial::Point<Scalar, D>& pos, Scalar mass, Scalar G, Scalar eps
+	) {
+		std::pair<std::array<Scalar, D>, Scalar> sums;
+
+		#ifdef GALAXY_X86_SIMD
+			if constexpr (std::is_same_v<Scalar, double>) {
+				if (isa == Isa::avx512) {
+					sums = p2p_avx512<D>(p, begin, end, pos, eps);
+				} else if (isa == Isa::avx2) {
+					sums = p2p_avx2<D>(p, begin, end, pos, eps);
+				} else {
+					sums = p2p_scalar<Scalar, D>(p, begin, end, pos, eps);
+				}
+			} else
+		#endif
+		{
+			sums = p2p_scalar<Scalar, D>(p, begin, end, pos, eps);
+		}
+
+		spatial::Vector<Scalar, D> acc;
+		for (std::size_t d = 0; d < D; ++d) {
+			acc[d] = G * sums.first[d];
+		}
+		return std::make_pair(acc, -G * mass * sums.second / 2);
+	}
+
+	/*
+	 * Interactions of the particles [a_begin, a_end) with [b_begin, b_end),
+	 * added to `field` on both sides (Newton's third law). The ranges are
+	 * either disjoint or equal, in which case every pair inside is taken once.
+	 */
+	template<typename Scalar, spatial::Dimension D>
+	void p2p_pairs(
+		Isa isa, const Particles<Scalar, D>& p, Field<Scalar, D>& field,
+		std::size_t a_begin, std::size_t a_end, std::size_t b_begin, std::size_t b_end, Scalar eps
+	) {
+		#ifdef GALAXY_X86_SIMD
+			if constexpr (std::is_same_v<Scalar, double>) {
+				if (isa == Isa::avx512) {
+					p2p_pairs_avx512<D>(p, field, a_begin, a_end, b_begin, b_end, eps);
+					return;
+				} else if (isa == Isa::avx2) {
+					p2p_pairs_avx2<D>(p, field, a_begin, a_end, b_begin, b_end, eps);
+					return;
+				}
+			}
+		#endif
+		p2p_pairs_scalar<Scalar, D>(p, field, a_begin, a_end, b_begin, b_end, eps);
+	}
+
+	/* Multipole moments of the particles [begin, end), which must not be massless. */
+	template<std::size_t Order, typename Scalar, spatial::Dimension D>
+	gravity::Moments<Scalar, D, Order> p2m(Isa isa, const Particles<Scalar, D>& p, std::size_t begin, std::size_t end) {
+		LeafSums<Scalar, D> sums;
+
+		#ifdef GALAXY_X86_SIMD
+			if constexpr (std::is_same_v<Scalar, double>) {
+				if (isa == Isa::avx512) {
+					sums = p2m_avx512<D>(p, begin, end);
+				} else if (isa == Isa::avx2) {
+					sums = p2m_avx2<D>(p, begin, end);
+				} else {
+					sums = p2m_scalar<Scalar, D>(p, begin, end);
+				}
+			} else
+		#endif
+		{
+			sums = p2m_scalar<Scalar, D>(p, begin, end);
+		}
+
+		gravity::Moments<Scalar, D, Order> res;
+		res.mass = sums.mass;
+		for (std::size_t d = 0; d < D; ++d) {
+			res.center[d] = sums.center[d];
+		}
+
+		if constexpr (Order >= 2) {
+			for (std::size_t a = 0; a < D; ++a) {
+				for (std::size_t b = a; b < D; ++b) {
+					res.quad(a, b) = res.quad(b, a) = sums.second[a*D + b];
+				}
+			}
+		}
+
+		if constexpr (Order >= 3) {
+			for (std::size_t i = begin; i < end; ++i) {
+				std::array<Scalar, D> y;
+				for (std::size_t d = 0; d < D; ++d) {
+					y[d] = p.pos[d][i] - res.center[d];
+				}
+				for (std::size_t a = 0; a < D; ++a) {
+					for (std::size_t b = 0; b < D; ++b) {
+						for (std::size_t c = 0; c < D; ++c) {
+							res.oct[a](b, c) += p.mass[i]*y[a]*y[b]*y[c];
+						}
+					}
+				}
+			}
+		}
+
+		return res;
+	}
+}
+
+#endif
@@ -1,13 +1,25 @@
 #include <iostream>
 #include <vector>
 #include <csignal>
+#include <optional>
+#include <string>
 #include "config.hpp"
 #include "spatial.hpp"
 #include "simulation.hpp"
 #include "mass_distribution.hpp"
 #include "integration.hpp"
+#include "snapshot.hpp"
+#include "replay.hpp"
 
-#ifdef USE_OPENCV_GRAPHICS
+#include "graphics/null/graphics.hpp"
+#include "graphics/async.hpp"
+
+#if defined(USE_NULL_GRAPHICS)
+	namespace graphics {
+		using Graphics2D = NullGraphics;
+		using Graphics3D = NullGraphics;
+	}
+#elif defined(USE_OPENCV_GRAPHICS)
 	#include "graphics/opencv/graphics_2d.hpp"
 	#include "graphics/opencv/graphics_3d.hpp"
 
@@ -29,42 +41,166 @@ namespace signals {
 }
 
 
-template<typename Body, typename Graphics>
-void run(config::Config cfg, const config::Units& units) {
-	using Engine = simulation::TreeSimulationEngine<Body, Graphics>;
+struct Options {
+	std::string config_path = "simulation.toml";
+	bool headless = false;
+	std::optional<std::size_t> steps;
+	std::optional<std::string> restart;
+	std::optional<std::string> replay;
+};
+
+/*
+ * Usage: galaxy [config.toml] [--headless] [--steps N] [--restart snapshot.bin] [--replay snapshots]
+ * Options override the corresponding configuration values.
+ */
+Options parse_args(const std::vector<std::string>& args) {
+	Options options;
+	bool has_config = false;
+
+	for (std::size_t i = 0; i < args.size(); ++i) {
+		if (args[i] == "--headless") {
+			options.headless = true;
+		} else if (args[i] == "--steps" && i + 1 < args.size()) {
+			options.steps = std::stoull(args[++i]);
+		} else if (args[i] == "--restart" && i + 1 < args.size()) {
+			options.restart = args[++i];
+		} else if (args[i] == "--replay" && i + 1 < args.size()) {
+			options.replay = args[++i];
+		} else if (!args[i].starts_with("--") && !has_config) {
+			options.config_path = args[i];
+			has_config = true;
+		} else {
+			throw config::configuration_error("Invalid command line argument " + args[i] + ".");
+		}
+	}
+
+	return options;
+}
+
+
+template<typename Engine>
+void run(config::Config cfg, const config::Units& units, const Options& options) {
+	using Body = typename Engine::Body;
 
 	auto intm = integration::get<Body>(cfg.get_or_fail("simulation.integration"));
-	auto mdist = mass_distribution::get<Body, Engine>(cfg.get_or_fail("simulation.mass_distribution"));
 
-	Engine sim(cfg, units, intm, mdist);
+	std::optional<Engine> engine;
+	if (options.restart) {
+		engine.emplace(cfg, units, intm, snapshot::read(*options.restart));
+	} else {
+		auto mdist = mass_distribution::get<Body, Engine>(cfg.get_or_fail("simulation.mass_distribution"));
+		engine.emplace(cfg, units, intm, mdist);
+	}
+	auto& sim = *engine;
+
+	// Steps are counted from the start of the simulation, restarts included
+	auto steps = options.steps ? options.steps : cfg.get<std::size_t>("simulation.steps");
 
-	while(signals::ok_status) {
+	auto snapshot_interval = cfg.get<std::size_t>("simulation.snapshot.interval").value_or(0);
+	std::optional<snapshot::Writer> snapshots;
+	if (snapshot_interval > 0) {
+		snapshots.emplace(cfg);
+	}
+	auto last_snapshot = sim.steps();
+
+	while (signals::ok_status && (!steps || sim.steps() < *steps)) {
 		if (!sim.step()) {
 			break;
 		}
+
+		if (snapshots && sim.steps() % snapshot_interval == 0) {
+			snapshots->push(sim.snapshot());
+			last_snapshot = sim.steps();
+		}
+	}
+
+	// Keep the progress of interrupted runs
+	if (snapshots && last_snapshot != sim.steps()) {
+		snapshots->push(sim.snapshot());
+	}
+	#ifdef USE_OPENCV_GRAPHICS
+		video::Writer::handle_exit();
+	#endif
+}
+
+template<typename Body, typename Graphics>
+void run_engine(config::Config cfg, const config::Units& units, const Options& options) {
+	auto type = cfg.get_or_fail<std::string>("simulation.engine.type");
+
+	if (type == "tree") {
+		auto order = cfg.get<std::size_t>("simulation.engine.order").value_or(1);
+
+		if (order == 1) {
+			run<simulation::TreeSimulationEngine<Body, Graphics, 1>>(cfg, units, options);
+		} else if (order == 2) {
+			run<simulation::TreeSimulationEngine<Body, Graphics, 2>>(cfg, units, options);
+		} else if (order == 3) {
+			run<simulation::TreeSimulationEngine<Body, Graphics, 3>>(cfg, units, options);
+		} else {
+			throw config::configuration_error("Unsupported multipole order.");
+		}
+	} else if (type == "fmm") {
+		run<simulation::FMMSimulationEngine<Body, Graphics>>(cfg, units, options);
+	} else if (type == "direct") {
+		run<simulation::DirectSimulationEngine<Body, Graphics>>(cfg, units, options);
+	} else {
+		config::backend_fail("engine");
 	}
+}
+
+
+template<typename Body, typename Graphics>
+void run_replay(config::Config cfg, const config::Units& units, const Options& options) {
+	replay::Player<Body, Graphics> player(cfg, units, replay::frames(*options.replay));
+
+	while (signals::ok_status && player.step()) {}
 	#ifdef USE_OPENCV_GRAPHICS
 		video::Writer::handle_exit();
 	#endif
 }
 
 
+template<typename Body, typename Graphics>
+void run_graphics(config::Config cfg, const config::Units& units, const Options& options) {
+	auto headless = options.headless || cfg.get<bool>("simulation.headless").value_or(false);
+
+	// Recorded videos need every step drawn, macOS allows windows only on the main thread
+	#ifdef __APPLE__
+		bool async_default = false;
+	#else
+		bool async_default = !cfg.get("simulation.video.output").has_value();
+	#endif
+	auto async = cfg.get<bool>("simulation.video.async").value_or(async_default);
+
+	if (options.replay) {
+		run_replay<Body, Graphics>(cfg, units, options);
+	} else if (headless || Graphics::headless) {
+		run_engine<Body, graphics::NullGraphics>(cfg, units, options);
+	} else if (async) {
+		run_engine<Body, graphics::AsyncGraphics<Body, Graphics>>(cfg, units, options);
+	} else {
+		run_engine<Body, Graphics>(cfg, units, options);
+	}
+}
+
+
 int main(int argc, char** argv) {
 	try {
 		std::signal(SIGINT, signals::signal_handler);
+		std::signal(SIGTERM, signals::signal_handler);
 
-		std::vector<std::string> args(argv + 1, argv + argc);
+		auto options = parse_args(std::vector<std::string>(argv + 1, argv + argc));
 
-		auto mgr = config::ConfigurationManager(args.empty() ? "simulation.toml" : args[0]);
+		auto mgr = config::ConfigurationManager(options.config_path);
 		auto cfg = mgr.get_config();
 		config::Units units(cfg);
 
 		auto dim = cfg.get_or_fail<spatial::Dimension>("simulation.dim");
 
 		if (dim == 2) {
-			run<simulation::Body2D<double>, graphics::Graphics2D>(cfg, units);
+			run_graphics<simulation::Body2D<double>, graphics::Graphics2D>(cfg, units, options);
 		} else if (dim == 3) {
-			run<simulation::Body3D<double>, graphics::Graphics3D>(cfg, units);
+			run_graphics<simulation::Body3D<double>, graphics::Graphics3D>(cfg, units, options);
 		} else {
 			throw config::configuration_error("Unsupported simulation dimension.");
 		}
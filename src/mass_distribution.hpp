@@ -2,22 +2,71 @@
 #define GALAXY_MASS_DISTRIBUTION_H
 
 #include <numbers>
-#include <random>
 #include <functional>
 #include <vector>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <limits>
+#include <optional>
 #include "config.hpp"
+#include "parallel.hpp"
+#include "equilibrium.hpp"
 
 
 namespace mass_distribution {
 	template<typename Body, typename Engine>
 	using MassDistribution = std::function<void(config::Config, Engine*)>;
 
+	/* Bodies per chunk of the generators. */
+	static constexpr std::size_t grain = 4096;
+
 	double deg2rad(double deg) {
 		return deg * std::numbers::pi/180;
 	}
 
+	/* SplitMix64 finalizer, a bijective mix of all bits. */
+	inline std::uint64_t mix64(std::uint64_t x) {
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+		return x ^ (x >> 31);
+	}
+
+	/*
+	 * Counter-based random numbers: the k-th number of stream `stream` is a
+	 * hash of (seed, stream, k), so every body draws from its own stream and
+	 * the result does not depend on which thread generates it. Distributions
+	 * are computed here instead of by <random>, whose results differ between
+	 * standard libraries.
+	 */
+	class Stream {
+	private:
+		std::uint64_t key_;
+		std::uint64_t counter_ = 0;
+
+	public:
+		Stream(std::uint64_t seed, std::uint64_t stream): key_(mix64(seed ^ mix64(stream + 0x9e3779b97f4a7c15ull))) {}
+
+		std::uint64_t next() {
+			return mix64(key_ + (++counter_) * 0x9e3779b97f4a7c15ull);
+		}
+
+		/* Uniform in [0, 1). */
+		double uniform() {
+			return (next() >> 11) * 0x1.0p-53;
+		}
+
+		double uniform(double a, double b) {
+			return a + (b - a)*uniform();
+		}
+
+		double exponential(double lambda) {
+			return -std::log1p(-uniform()) / lambda;
+		}
+	};
+
 	template<typename Body>
-	void transform(config::Config mcfg, std::vector<Body>& bodies) {
+	void transform(config::Config mcfg, std::vector<Body>& bodies, parallel::ThreadPool& pool) {
 		double offset_x = mcfg.get<double>("offset.x").value_or(0.);
 		double offset_y = mcfg.get<double>("offset.y").value_or(0.);
 
@@ -31,18 +80,62 @@ namespace mass_distribution {
 			double rot_z = deg2rad(mcfg.get<double>("rotation.z").value_or(0.));
 
 			auto rmat = spatial::rotation(rot_x, rot_y, rot_z);
-			for (auto& body : bodies) {
-				body.pos = rmat*body.pos;
-				body.vel = rmat*body.vel;
-			}
+			pool.for_each(bodies.size(), [&](std::size_t begin, std::size_t end) {
+				for (std::size_t i = begin; i < end; ++i) {
+					bodies[i].pos = rmat*bodies[i].pos;
+					bodies[i].vel = rmat*bodies[i].vel;
+				}
+			}, grain);
 
 		} else {
 			offset = typename Body::Vector({offset_x, offset_y});
 		}
 
-		for (auto& body : bodies) {
-			body.pos += offset;
-		}
+		pool.for_each(bodies.size(), [&](std::size_t begin, std::size_t end) {
+			for (std::size_t i = begin; i < end; ++i) {
+				bodies[i].pos += offset;
+			}
+		}, grain);
+	}
+
+	/*
+	 * Appends `N` bodies of mass `mass`, body `i` is filled in by
+	 * `sample(stream, body)` from its own stream seeded by `seed` and its
+	 * index in the engine. Bodies are sampled in parallel. Returns the index
+	 * of the first new body.
+	 */
+	template<typename Body, typename Engine, typename Sample>
+	std::size_t append(Engine* eng, std::uint64_t seed, std::size_t N, double mass, Sample&& sample) {
+		auto& bodies = eng->bodies;
+		auto prev_size = bodies.size();
+		bodies.resize(prev_size + N, Body(typename Body::Point(), typename Body::Vector(), mass));
+
+		eng->pool().for_each(N, [&](std::size_t begin, std::size_t end) {
+			for (std::size_t i = begin; i < end; ++i) {
+				Stream stream(seed, prev_size + i);
+				sample(stream, bodies[prev_size + i]);
+			}
+		}, grain);
+		return prev_size;
+	}
+
+	/*
+	 * Appends `N` bodies of mass `total_mass`/`N` at positions drawn by
+	 * `sample(stream)`, see append(), with `seed` (default 0). Then they get
+	 * their velocities and the distribution's transform.
+	 */
+	template<typename Body, typename Engine, typename Sample>
+	void generate(config::Config mcfg, Engine* eng, Sample&& sample) {
+		std::size_t N = mcfg.get_or_fail<std::size_t>("N");
+		double total_mass = mcfg.get_or_fail<double>("total_mass");
+		auto seed = mcfg.get<std::uint64_t>("seed").value_or(0);
+
+		auto prev_size = append<Body>(eng, seed, N, total_mass/N, [&](Stream& stream, Body& body) {
+			body.pos = sample(stream);
+		});
+
+		eng->init_vels(eng->bodies.begin()+prev_size, eng->bodies.end());
+		transform(mcfg, eng->bodies, eng->pool());
 	}
 
 	template<typename Body, typename Engine>
@@ -56,56 +149,172 @@ namespace mass_distribution {
 		eng->bodies.emplace_back(typename Body::Point({ 20., 0.}), vel, total_mass/2);
 
 		eng->init_vels(eng->bodies.begin()+prev_size, eng->bodies.end());
-		transform(mcfg, eng->bodies);
+		transform(mcfg, eng->bodies, eng->pool());
 	}
 
 	template<typename Body, typename Engine>
 	void simple_exponential(config::Config mcfg, Engine* eng) {
-		std::size_t N = mcfg.get_or_fail<std::size_t>("N");
-		double total_mass = mcfg.get_or_fail<double>("total_mass");
 		double lambda = mcfg.get_or_fail<double>("lambda");
 
-		std::uniform_real_distribution<typename Body::Scalar> ang_dist(-std::numbers::pi, std::numbers::pi);
-		std::exponential_distribution<typename Body::Scalar> r_dist(lambda);
-		std::default_random_engine re;
+		generate<Body>(mcfg, eng, [lambda](Stream& stream) {
+			auto ang = stream.uniform(-std::numbers::pi, std::numbers::pi);
+			auto r = stream.exponential(lambda);
 
-		auto prev_size = eng->bodies.size();
-		for (std::size_t i = 0; i < N; ++i) {
-			auto ang = ang_dist(re);
-			auto r = r_dist(re);
+			return typename Body::Point({std::cos(ang)*r, std::sin(ang)*r});
+		});
+	}
+
+	template<typename Body, typename Engine>
+	void simple_exponential_sphere(config::Config mcfg, Engine* eng) {
+		double lambda = mcfg.get_or_fail<double>("lambda");
+
+		generate<Body>(mcfg, eng, [lambda](Stream& stream) {
+			auto ang1 = stream.uniform(-std::numbers::pi, std::numbers::pi);
+			auto ang2 = stream.uniform(-std::numbers::pi, std::numbers::pi);
+			auto r = stream.exponential(lambda);
+
+			return typename Body::Point({std::sin(ang1)*std::cos(ang2)*r, std::sin(ang1)*std::sin(ang2)*r, std::cos(ang1)*r});
+		});
+	}
 
-			typename Body::Point pos({std::cos(ang)*r, std::sin(ang)*r});
-			typename Body::Vector vel({0, 0});
-			eng->bodies.emplace_back(pos, vel, total_mass/N);
+	/* Spherical component of `profile` ("plummer", "hernquist" or "nfw") configured by `ccfg`. */
+	struct SphericalConfig {
+		std::size_t N;
+		double total_mass;
+		double scale;
+		double r_max;
+		std::function<double(double)> density;
+	};
+
+	SphericalConfig spherical_config(config::Config ccfg, const std::string& profile) {
+		SphericalConfig res;
+		res.N = ccfg.get_or_fail<std::size_t>("N");
+		res.total_mass = ccfg.get_or_fail<double>("total_mass");
+		res.scale = ccfg.get_or_fail<double>("a");
+
+		if (profile == "nfw") {
+			auto r_vir = ccfg.get<double>("concentration").value_or(10.)*res.scale;
+			res.r_max = ccfg.get<double>("r_max").value_or(3*r_vir);
+			res.density = equilibrium::nfw(res.scale, r_vir);
+		} else {
+			res.r_max = ccfg.get<double>("r_max").value_or(100*res.scale);
+			res.density = profile == "plummer" ? equilibrium::plummer(res.scale) : equilibrium::hernquist(res.scale);
 		}
 
-		eng->init_vels(eng->bodies.begin()+prev_size, eng->bodies.end());
-		transform(mcfg, eng->bodies);
+		if (res.N == 0 || res.scale <= 0 || res.r_max <= 0) {
+			throw config::configuration_error("Invalid configuration of the '" + profile + "' distribution.");
+		}
+		return res;
 	}
 
 	template<typename Body, typename Engine>
-	void simple_exponential_sphere(config::Config mcfg, Engine* eng) {
-		std::size_t N = mcfg.get_or_fail<std::size_t>("N");
-		double total_mass = mcfg.get_or_fail<double>("total_mass");
-		double lambda = mcfg.get_or_fail<double>("lambda");
+	void append_sampled(Engine* eng, std::uint64_t seed, std::size_t N, double mass, const auto& sampler, auto&&... args) {
+		using Scalar = typename Body::Scalar;
 
-		std::uniform_real_distribution<typename Body::Scalar> ang1_dist(-std::numbers::pi, std::numbers::pi);
-		std::uniform_real_distribution<typename Body::Scalar> ang2_dist(-std::numbers::pi, std::numbers::pi);
-		std::exponential_distribution<typename Body::Scalar> r_dist(lambda);
-		std::default_random_engine re;
+		append<Body>(eng, seed, N, mass, [&](Stream& stream, Body& body) {
+			auto [pos, vel] = sampler.sample(stream, args...);
+			body.pos = typename Body::Point({(Scalar)pos[0], (Scalar)pos[1], (Scalar)pos[2]});
+			body.vel = typename Body::Vector({(Scalar)vel[0], (Scalar)vel[1], (Scalar)vel[2]});
+		});
+	}
 
-		auto prev_size = eng->bodies.size();
-		for (std::size_t i = 0; i < N; ++i) {
-			auto ang1 = ang1_dist(re);
-			auto ang2 = ang2_dist(re);
-			auto r = r_dist(re);
+	/*
+	 * Plummer, Hernquist and NFW spheres in equilibrium, velocities come from
+	 * their distribution functions, see equilibrium::Spherical.
+	 */
+	template<typename Body, typename Engine>
+	void spherical(config::Config mcfg, Engine* eng) {
+		auto profile = mcfg.get_or_fail<std::string>("type");
+		auto component = spherical_config(mcfg, profile);
+
+		equilibrium::Grid grid(1e-4*component.scale, component.r_max);
+		auto mass = grid.enclosed_mass(component.density, component.total_mass, component.r_max);
+		equilibrium::Spherical sampler(grid, component.density, mass, component.r_max, grid.potential(mass, eng->G));
 
-			typename Body::Point pos({std::sin(ang1)*std::cos(ang2)*r, std::sin(ang1)*std::sin(ang2)*r, std::cos(ang1)*r});
-			typename Body::Vector vel({0, 0, 0});
-			eng->bodies.emplace_back(pos, vel, total_mass/N);
+		append_sampled<Body>(eng, mcfg.get<std::uint64_t>("seed").value_or(0), component.N, component.total_mass/component.N, sampler);
+
+		transform(mcfg, eng->bodies, eng->pool());
+	}
+
+	/*
+	 * Galaxy of an exponential disk (`disk`), a Hernquist bulge (`bulge`) and
+	 * an NFW halo (`halo`), each of them optional. The spherical components
+	 * follow the distribution functions of the total potential, disk bodies
+	 * move on its circular orbits, see equilibrium::Disk.
+	 */
+	template<typename Body, typename Engine>
+	void galaxy(config::Config mcfg, Engine* eng) {
+		auto seed = mcfg.get<std::uint64_t>("seed").value_or(0);
+		auto disk_cfg = mcfg.get("disk");
+		auto bulge_cfg = mcfg.get("bulge");
+		auto halo_cfg = mcfg.get("halo");
+
+		std::vector<SphericalConfig> components;
+		if (bulge_cfg) {
+			components.push_back(spherical_config(*bulge_cfg, "hernquist"));
 		}
-		eng->init_vels(eng->bodies.begin()+prev_size, eng->bodies.end());
-		transform(mcfg, eng->bodies);
+		if (halo_cfg) {
+			components.push_back(spherical_config(*halo_cfg, "nfw"));
+		}
+
+		double r_min = std::numeric_limits<double>::infinity();
+		double r_max = 0;
+		for (auto&& c : components) {
+			r_min = std::min(r_min, 1e-4*c.scale);
+			r_max = std::max(r_max, c.r_max);
+		}
+
+		std::optional<equilibrium::Disk> disk;
+		std::size_t disk_N = 0;
+		double disk_mass = 0;
+		if (disk_cfg) {
+			disk_N = disk_cfg->get_or_fail<std::size_t>("N");
+			disk_mass = disk_cfg->get_or_fail<double>("total_mass");
+			auto scale_length = disk_cfg->get_or_fail<double>("scale_length");
+			auto disk_r_max = disk_cfg->get<double>("r_max").value_or(10*scale_length);
+			if (disk_N == 0 || scale_length <= 0) {
+				throw config::configuration_error("Invalid configuration of the galaxy disk.");
+			}
+
+			disk.emplace(disk_mass, scale_length,
+				disk_cfg->get<double>("scale_height").value_or(0.1*scale_length),
+				disk_cfg->get<double>("dispersion").value_or(0.1),
+				disk_r_max
+			);
+			r_min = std::min(r_min, 1e-4*scale_length);
+			r_max = std::max(r_max, disk_r_max);
+		}
+
+		if (!disk && components.empty()) {
+			throw config::configuration_error("The galaxy needs a disk, a bulge or a halo.");
+		}
+
+		equilibrium::Grid grid(r_min, r_max);
+		std::vector<std::vector<double>> masses;
+		std::vector<double> total(grid.size());
+		for (auto&& c : components) {
+			masses.push_back(grid.enclosed_mass(c.density, c.total_mass, c.r_max));
+		}
+		if (disk) {
+			masses.push_back(disk->enclosed_mass(grid));
+		}
+		for (auto&& mass : masses) {
+			for (std::size_t i = 0; i < grid.size(); ++i) {
+				total[i] += mass[i];
+			}
+		}
+		auto psi = grid.potential(total, eng->G);
+
+		for (std::size_t k = 0; k < components.size(); ++k) {
+			auto& c = components[k];
+			equilibrium::Spherical sampler(grid, c.density, masses[k], c.r_max, psi);
+			append_sampled<Body>(eng, seed, c.N, c.total_mass/c.N, sampler);
+		}
+		if (disk) {
+			append_sampled<Body>(eng, seed, disk_N, disk_mass/disk_N, *disk, grid, total, (double)eng->G);
+		}
+
+		transform(mcfg, eng->bodies, eng->pool());
 	}
 
 	template<typename Body, typename Engine>
@@ -125,6 +334,10 @@ namespace mass_distribution {
 		if constexpr (Body::Dim >= 3) {
 			if (name == "simple_exponential_sphere") {
 				return simple_exponential_sphere<Body, Engine>;
+			} else if (name == "plummer" || name == "hernquist" || name == "nfw") {
+				return spherical<Body, Engine>;
+			} else if (name == "galaxy") {
+				return galaxy<Body, Engine>;
 			}
 		}
 
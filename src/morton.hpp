@@ -0,0 +1,148 @@
+#ifndef GALAXY_MORTON_H
+#define GALAXY_MORTON_H
+
+#include <vector>
+#include <array>
+#include <span>
+#include <cstdint>
+#include <algorithm>
+
+#include "spatial.hpp"
+#include "parallel.hpp"
+
+
+namespace morton {
+	using Key = std::uint64_t;
+
+	/* Key of points outside of the encoded box, sorts after every valid key. */
+	static constexpr Key invalid_key = ~Key(0);
+
+	/* Number of bits per axis, chosen so that a key never collides with `invalid_key`. */
+	template<spatial::Dimension D>
+	static constexpr std::size_t bits = std::min<std::size_t>(63/D, 32);
+
+	template<spatial::Dimension D>
+	inline Key spread(std::uint32_t x) {
+		Key v = x;
+		if constexpr (D == 2) {
+			v = (v | (v << 16)) & 0x0000ffff0000ffffull;
+			v = (v | (v << 8))  & 0x00ff00ff00ff00ffull;
+			v = (v | (v << 4))  & 0x0f0f0f0f0f0f0f0full;
+			v = (v | (v << 2))  & 0x3333333333333333ull;
+			v = (v | (v << 1))  & 0x5555555555555555ull;
+			return v;
+		} else if constexpr (D == 3) {
+			v &= 0x1fffff;
+			v = (v | (v << 32)) & 0x001f00000000ffffull;
+			v = (v | (v << 16)) & 0x001f0000ff0000ffull;
+			v = (v | (v << 8))  & 0x100f00f00f00f00full;
+			v = (v | (v << 4))  & 0x10c30c30c30c30c3ull;
+			v = (v | (v << 2))  & 0x1249249249249249ull;
+			return v;
+		} else {
+			Key res = 0;
+			for (std::size_t b = 0; b < bits<D>; ++b) {
+				res |= ((v >> b) & 1) << (b*D);
+			}
+			return res;
+		}
+	}
+
+	/*
+	 * Z-order key of `pt` within `box`. The top D bits select the child of the
+	 * root (bit d set for the upper half along axis d, same as Box::octant()),
+	 * the next D bits the grandchild and so on.
+	 */
+	template<typename T, spatial::Dimension D>
+	inline Key encode(const spatial::Box<T, D>& box, const spatial::Point<T, D>& pt) {
+		if (!box.contains(pt)) {
+			return invalid_key;
+		}
+
+		static constexpr T cells = T(std::uint64_t(1) << bits<D>);
+
+		Key res = 0;
+		for (std::size_t d = 0; d < D; ++d) {
+			auto rel = (pt[d] - box.center[d] + box.extent[d]) / (2*box.extent[d]);
+			auto q = static_cast<std::uint32_t>(std::clamp(rel*cells, T(0), cells - 1));
+			res |= spread<D>(q) << d;
+		}
+		return res;
+	}
+
+	/* Child index at `level` (0 = children of the root) encoded in `key`. */
+	template<spatial::Dimension D>
+	inline std::size_t digit(Key key, std::size_t level) {
+		return (key >> ((bits<D> - 1 - level)*D)) & ((1 << D) - 1);
+	}
+
+	/*
+	 * Stable LSD radix sort of `keys` along with `values`, 8 bits per pass.
+	 *
+	 * Every pass builds per-chunk histograms and scatters the chunks in
+	 * parallel. Passes over a byte shared by all keys are skipped.
+	 * `keys_tmp` and `values_tmp` are scratch buffers kept by the caller.
+	 */
+	template<typename V>
+	void radix_sort(
+		std::vector<Key>& keys, std::vector<V>& values,
+		std::vector<Key>& keys_tmp, std::vector<V>& values_tmp,
+		parallel::ThreadPool& pool
+	) {
+		static constexpr std::size_t radix = 256;
+		static constexpr std::size_t grain = 1 << 14;
+
+		auto n = keys.size();
+		auto chunks = (n + grain - 1)/grain;
+
+		keys_tmp.resize(n);
+		values_tmp.resize(n);
+		std::vector<std::array<std::size_t, radix>> offsets(chunks);
+
+		for (std::size_t shift = 0; shift < 64; shift += 8) {
+			pool.for_chunks(chunks, [&](std::size_t chunk) {
+				auto& hist = offsets[chunk];
+				hist.fill(0);
+				for (std::size_t i = chunk*grain; i < std::min(n, (chunk+1)*grain); ++i) {
+					++hist[(keys[i] >> shift) & (radix - 1)];
+				}
+			});
+
+			std::size_t total = 0;
+			bool trivial = false;
+			for (std::size_t r = 0; r < radix; ++r) {
+				std::size_t count = 0;
+				for (auto&& hist : offsets) {
+					count += hist[r];
+				}
+				if (count == n) {
+					trivial = true;
+					break;
+				}
+
+				for (auto&& hist : offsets) {
+					auto c = hist[r];
+					hist[r] = total;
+					total += c;
+				}
+			}
+			if (trivial) {
+				continue;
+			}
+
+			pool.for_chunks(chunks, [&](std::size_t chunk) {
+				auto& pos = offsets[chunk];
+				for (std::size_t i = chunk*grain; i < std::min(n, (chunk+1)*grain); ++i) {
+					auto dst = pos[(keys[i] >> shift) & (radix - 1)]++;
+					keys_tmp[dst] = keys[i];
+					values_tmp[dst] = values[i];
+				}
+			});
+
+			keys.swap(keys_tmp);
+			values.swap(values_tmp);
+		}
+	}
+}
+
+#endif
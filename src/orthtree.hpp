@@ -2,8 +2,16 @@
 #define GALAXY_ORTHTREE_H
 
 #include <vector>
+#include <array>
+#include <span>
+#include <ranges>
+#include <limits>
+#include <cstdint>
+#include <cassert>
 
 #include "spatial.hpp"
+#include "parallel.hpp"
+#include "morton.hpp"
 
 namespace orthtree {
 	struct EmptyVal {};
@@ -12,6 +20,7 @@ namespace orthtree {
 	class OrthTreeDefaultPolicy {
 	public:
 		using Item = Point;
+		using NumType = std::remove_cvref_t<decltype(std::declval<Point>()[0])>;
 		using GetPoint = std::identity;
 		using AccumType = EmptyVal;
 
@@ -23,157 +32,429 @@ namespace orthtree {
 		OrthTreeDefaultPolicy(std::size_t node_capacity) : node_capacity(node_capacity) {}
 	};
 
-	template<typename T, spatial::Dimension Dim, typename Policy = OrthTreeDefaultPolicy<spatial::Point<T, Dim>>>
-	class OrthTree;
+	/* Policy for trees over items with their own `GetPoint`, without accumulated values. */
+	template<typename T>
+	class OrthTreeItemPolicy {
+	public:
+		using Item = T;
+		using NumType = typename T::Scalar;
+		using GetPoint = typename T::GetPoint;
+		using AccumType = EmptyVal;
+
+		static constexpr bool use_accum = false;
+		AccumType initial;
+
+		std::size_t node_capacity = 1;
+	};
 
+	/*
+	 * Orthtree (quadtree/octree) stored as a flat array of nodes.
+	 *
+	 * Nodes are addressed by index, the 2^Dim children of a node are stored
+	 * next to each other, and items are referenced by their index into the
+	 * element span the tree was built over. Every node owns a contiguous range
+	 * of the index permutation `order_`, so the items of any subtree are
+	 * a single slice of it.
+	 *
+	 * All buffers keep their capacity between rebuilds, so rebuilding a tree
+	 * of a similar size does not allocate.
+	 *
+	 * If the policy provides a `Merge` functor, only leaves run `Accum` over
+	 * their items and inner nodes merge the values of their children.
+	 *
+	 * After the elements move, `refit()` updates the tree in place instead of
+	 * rebuilding it. Node boxes then grow to cover items that left their cell.
+	 */
 	template<typename T, spatial::Dimension Dim, typename Policy = OrthTreeDefaultPolicy<spatial::Point<T, Dim>>>
-	class TNode {
+	class OrthTree {
+	public:
+		using Index = std::uint32_t;
+		using Box = spatial::Box<typename Policy::NumType, Dim>;
+
+		static constexpr std::size_t fanout = 1 << Dim;
+		static constexpr Index none = std::numeric_limits<Index>::max();
+		static constexpr std::size_t max_depth = 64;
+
+		struct Node {
+			Box bbox;
+			typename Policy::AccumType accum_value;
+
+			Index first_child = none;
+			Index begin = 0;
+			Index end = 0;
+
+			bool is_leaf() const {
+				return first_child == none;
+			}
+
+			bool empty() const {
+				return begin == end;
+			}
+
+			std::size_t size() const {
+				return end - begin;
+			}
+		};
+
 	private:
-		friend class OrthTree<T, Dim, Policy>;
+		const Policy& policy_;
+		std::span<const T> elements_;
 
-		const Policy& policy;
+		std::vector<Node> nodes_;
+		std::vector<Index> order_;
 
-		bool subdivide() {
-			//std::cout << "subdivide\n";
-			children.emplace();
+		std::vector<Index> scratch_;
+		std::vector<std::uint8_t> codes_;
 
-			(*children)[0] = std::make_unique<TNode>(policy, bbox);
+		std::vector<morton::Key> keys_;
+		std::vector<morton::Key> keys_scratch_;
+		std::vector<Index> permutation_;
+		std::vector<T> sorted_;
 
-			for (std::size_t d = 0; d < Dim; ++d) {
-				//std::cout << "split d=" << d << "\n";
-				for (std::size_t i = 0; i < 1<<d; ++i) {
-					//std::cout << "split i=" << i << "\n";
-					//std::cout << "access " << i << " and " << (1<<d) + i << "\n";
-					auto half = bbox.extent[d]/2;
-					auto left = bbox.center[d]-half;
-					auto right = bbox.center[d]+half;
-					//std::cout << "half=" << half << " left=" << left << " right=" << right << "\n";
+		std::vector<Index> outside_;
+		std::vector<Box> cells_;
 
-					(*children)[(1<<d) + i] = std::make_unique<TNode>(policy, (*children)[i]->bbox);
+		std::size_t depth_ = 0;
 
-					(*children)[i]->bbox.center[d] = left;
-					(*children)[i]->bbox.extent[d] = half;
+		void collect_outside() {
+			outside_.clear();
+			if (order_.size() == elements_.size()) {
+				return;
+			}
 
-					(*children)[(1<<d) + i]->bbox.center[d] = right;
-					(*children)[(1<<d) + i]->bbox.extent[d] = half;
+			std::vector<bool> in_tree(elements_.size(), false);
+			for (auto i : order_) {
+				in_tree[i] = true;
+			}
+			for (std::size_t i = 0; i < elements_.size(); ++i) {
+				if (!in_tree[i]) {
+					outside_.push_back(i);
 				}
 			}
-			//std::cout << "subdivision step ok\n";
+		}
+
+		static constexpr bool use_merge = requires { typename Policy::Merge; };
+
+		void accumulate(Index idx) {
+			auto& node = nodes_[idx];
+
+			if constexpr (use_merge) {
+				if (!node.is_leaf()) {
+					static constexpr typename Policy::Merge merge;
 
-			for (auto&& value : std::move(data)) {
-				auto ok = false;
-				for (std::size_t i = 0; i < 2 << Dim; ++i) {
-					if ((*children)[i]->insert(value)) {
-						ok = true;
-						break;
+					for (std::size_t c = 0; c < fanout; ++c) {
+						merge(node.accum_value, nodes_[node.first_child + c].accum_value);
 					}
-				}
-				if (!ok) {
-					return false;
+					return;
 				}
 			}
-			data.clear();
-			return true;
-		}
 
-		void accumulate(const T& value) {
 			static constexpr typename Policy::Accum accum;
 
-			accum(accum_value, value);
+			for (auto i = node.begin; i < node.end; ++i) {
+				accum(node.accum_value, elements_[order_[i]]);
+			}
 		}
 
-		bool insert(const T& value) {
+		void subdivide(Index idx) {
 			static constexpr typename Policy::GetPoint get_point;
-			auto point = get_point(value);
 
-			assert(!point.has_nan());
+			auto bbox = nodes_[idx].bbox;
+			auto begin = nodes_[idx].begin;
+			auto end = nodes_[idx].end;
+
+			// Counting sort of the node's items by child
+			std::array<Index, fanout + 1> offsets = {};
+			codes_.resize(end - begin);
+			for (auto i = begin; i < end; ++i) {
+				auto code = bbox.octant(get_point(elements_[order_[i]]));
+				codes_[i - begin] = code;
+				++offsets[code + 1];
+			}
+			for (std::size_t c = 0; c < fanout; ++c) {
+				offsets[c + 1] += offsets[c];
+			}
 
-			if (!bbox.contains(point)) {
-				return false;
+			scratch_.resize(end - begin);
+			auto fill = offsets;
+			for (auto i = begin; i < end; ++i) {
+				scratch_[fill[codes_[i - begin]]++] = order_[i];
+			}
+			std::copy(scratch_.begin(), scratch_.end(), order_.begin() + begin);
+
+			nodes_[idx].first_child = nodes_.size();
+			for (std::size_t c = 0; c < fanout; ++c) {
+				nodes_.push_back(Node {
+					bbox.child(c), {}, none,
+					begin + offsets[c], begin + offsets[c + 1]
+				});
 			}
+		}
 
-			//std::cout << "bbox: " << bbox.center[0] << " " << bbox.center[1] << "\n";
-			//std::cout << "part: " << value.pos[0] << " " << value.pos[1] << "\n";
+		void build_node(Index idx, std::size_t depth) {
+			depth_ = std::max(depth_, depth);
+			if (nodes_[idx].size() > policy_.node_capacity && depth < max_depth) {
+				subdivide(idx);
 
-			if (children.has_value()) {
-				for (auto&& child : *children) {
-					if (child->insert(value)) {
-						if constexpr (Policy::use_accum) {
-							accumulate(value);
-						}
+				auto first = nodes_[idx].first_child;
+				for (std::size_t c = 0; c < fanout; ++c) {
+					build_node(first + c, depth + 1);
+				}
+			}
 
-						return true;
-					}
+			if constexpr (Policy::use_accum) {
+				accumulate(idx);
+			}
+		}
+
+		/* Splits a node of the Morton-sorted tree by the key digit at `depth`. */
+		void build_sorted_node(Index idx, std::size_t depth) {
+			depth_ = std::max(depth_, depth);
+			if (nodes_[idx].size() > policy_.node_capacity && depth < morton::bits<Dim>) {
+				auto bbox = nodes_[idx].bbox;
+				auto begin = keys_.begin() + nodes_[idx].begin;
+				auto end = keys_.begin() + nodes_[idx].end;
+
+				auto first = static_cast<Index>(nodes_.size());
+				nodes_[idx].first_child = first;
+
+				for (std::size_t c = 0; c < fanout; ++c) {
+					auto split = std::partition_point(begin, end, [depth, c](morton::Key key) {
+						return morton::digit<Dim>(key, depth) <= c;
+					});
+
+					nodes_.push_back(Node {
+						bbox.child(c), {}, none,
+						static_cast<Index>(begin - keys_.begin()),
+						static_cast<Index>(split - keys_.begin())
+					});
+					begin = split;
 				}
-				return false;
-			} else {
-				if constexpr (Policy::use_accum) {
-					accumulate(value);
+
+				for (std::size_t c = 0; c < fanout; ++c) {
+					build_sorted_node(first + c, depth + 1);
 				}
+			}
 
-				data.push_back(value);
+			if constexpr (Policy::use_accum) {
+				accumulate(idx);
+			}
+		}
 
-				// TODO
-				if (data.size() > policy.node_capacity) {
-					return subdivide();
-				} else {
-					return true;
+	public:
+		explicit OrthTree(const Policy& policy) : policy_(policy) {}
+
+		OrthTree(const Policy& policy, const Box& bbox) : policy_(policy) {
+			build(bbox, {});
+		}
+
+		OrthTree(const Policy& policy, const Box& bbox, std::span<const T> elements) : policy_(policy) {
+			build(bbox, elements);
+		}
+
+		/*
+		 * Rebuilds the tree over `elements`, reusing the already allocated
+		 * storage. Elements outside of `bbox` are left out of the tree.
+		 */
+		void build(const Box& bbox, std::span<const T> elements) {
+			static constexpr typename Policy::GetPoint get_point;
+
+			elements_ = elements;
+			nodes_.clear();
+			order_.clear();
+			cells_.clear();
+			depth_ = 0;
+
+			for (std::size_t i = 0; i < elements_.size(); ++i) {
+				auto point = get_point(elements_[i]);
+				assert(!point.has_nan());
+
+				if (bbox.contains(point)) {
+					order_.push_back(i);
 				}
 			}
+
+			nodes_.push_back(Node { bbox, {}, none, 0, static_cast<Index>(order_.size()) });
+			build_node(0, 0);
+			collect_outside();
 		}
 
-	public:
-		std::vector<T> data;
-		typename Policy::AccumType accum_value;
-		std::optional<std::array<std::unique_ptr<TNode<T, Dim, Policy>>, 1 << Dim>> children;
-		spatial::Box<typename Policy::NumType, Dim> bbox;
+		/*
+		 * Rebuilds the tree by sorting the elements along the Z-order curve of
+		 * `bbox` and splitting the sorted sequence by key digits. Key generation
+		 * and sorting run on `pool`. The result has the same shape as `build()`
+		 * down to the resolution of the keys.
+		 */
+		void build_morton(const Box& bbox, std::span<const T> elements, parallel::ThreadPool& pool) {
+			static constexpr typename Policy::GetPoint get_point;
+
+			elements_ = elements;
+			nodes_.clear();
+			cells_.clear();
+			depth_ = 0;
 
-		TNode(const Policy& policy, const spatial::Box<typename Policy::NumType, Dim>& bbox) : policy(policy), bbox(bbox) {};
+			auto n = elements_.size();
+			keys_.resize(n);
+			order_.resize(n);
 
-		bool is_leaf() const {
-			return !children.has_value();
+			pool.for_each(n, [this, &bbox](std::size_t begin, std::size_t end) {
+				for (std::size_t i = begin; i < end; ++i) {
+					auto point = get_point(elements_[i]);
+					assert(!point.has_nan());
+
+					keys_[i] = morton::encode(bbox, point);
+					order_[i] = i;
+				}
+			}, 4096);
+
+			morton::radix_sort(keys_, order_, keys_scratch_, scratch_, pool);
+
+			// Elements outside of the box are sorted last
+			auto count = std::lower_bound(keys_.begin(), keys_.end(), morton::invalid_key) - keys_.begin();
+
+			nodes_.push_back(Node { bbox, {}, none, 0, static_cast<Index>(count) });
+			build_sorted_node(0, 0);
+
+			outside_.assign(order_.begin() + count, order_.end());
+			keys_.resize(count);
+			order_.resize(count);
 		}
-	};
 
-	template<typename T, spatial::Dimension Dim, typename Policy>
-	class OrthTree {
-	private:
-		const Policy& policy_;
-		TNode<T, Dim, Policy> root_;
+		/*
+		 * Permutes `elements` (the container the tree was built over) into tree
+		 * order, elements outside of the tree go last. The tree is updated to
+		 * refer to the new positions. Returns the permutation, the element now at
+		 * position i was at position permutation[i].
+		 */
+		std::span<const Index> sort_elements(std::vector<T>& elements) {
+			assert(elements.data() == elements_.data() && elements.size() == elements_.size());
+
+			permutation_.assign(order_.begin(), order_.end());
+			permutation_.insert(permutation_.end(), outside_.begin(), outside_.end());
+
+			sorted_.clear();
+			for (auto i : permutation_) {
+				sorted_.push_back(std::move(elements[i]));
+			}
+			elements.swap(sorted_);
 
-	public:
-		using Node = TNode<T, Dim, Policy>;
+			elements_ = elements;
+			for (std::size_t i = 0; i < order_.size(); ++i) {
+				order_[i] = i;
+			}
+			for (std::size_t i = 0; i < outside_.size(); ++i) {
+				outside_[i] = order_.size() + i;
+			}
+
+			return permutation_;
+		}
+
+		/*
+		 * Updates the tree after its elements moved, keeping its structure.
+		 *
+		 * Accumulated values are recomputed bottom-up and every node box is
+		 * grown from its original cell to cover the items in its subtree, so
+		 * the boxes stay valid bounds. Items are not moved between nodes.
+		 *
+		 * Returns the number of elements that are no longer in their leaf cell,
+		 * including elements outside of the tree that entered it. Rebuild the
+		 * tree once this gets too large.
+		 */
+		std::size_t refit(std::span<const T> elements) {
+			static constexpr typename Policy::GetPoint get_point;
+
+			assert(elements.size() == elements_.size());
+			elements_ = elements;
+
+			// Node boxes are still the cells right after a build
+			if (cells_.empty()) {
+				cells_.reserve(nodes_.size());
+				for (auto&& node : nodes_) {
+					cells_.push_back(node.bbox);
+				}
+			}
+
+			std::size_t escaped = 0;
+			for (std::size_t i = nodes_.size(); i-- > 0;) {
+				auto& node = nodes_[i];
+				if (node.empty()) {
+					continue;
+				}
+				node.bbox = cells_[i];
+
+				if (node.is_leaf()) {
+					for (auto&& item : items(node)) {
+						auto point = get_point(item);
+						if (!cells_[i].contains(point)) {
+							node.bbox.include(point);
+							++escaped;
+						}
+					}
+				} else {
+					for (auto&& child : children(node)) {
+						if (!child.empty()) {
+							node.bbox.include(child.bbox);
+						}
+					}
+				}
 
-		OrthTree(const Policy& policy, const spatial::Box<typename Policy::NumType, Dim>& bbox) : policy_(policy), root_(TNode<T, Dim, Policy>(policy_, bbox)) {}
-		
-		OrthTree(
-			const Policy& policy, 
-			const spatial::Box<typename Policy::NumType, Dim>& bbox,
-			const std::vector<T>& elements
-		) : OrthTree(policy, bbox, elements.begin(), elements.end()) {}
+				if constexpr (Policy::use_accum) {
+					node.accum_value = {};
+					accumulate(i);
+				}
+			}
 
-		template<typename Iter>
-		OrthTree(
-			const Policy& policy, 
-			const spatial::Box<typename Policy::NumType, Dim>& bbox,
-			Iter begin,
-			Iter end
-		) : OrthTree(policy, bbox) {
-			for (auto it = begin; it != end; ++it) {
-				insert(*it);
+			for (auto i : outside_) {
+				if (cells_.front().contains(get_point(elements_[i]))) {
+					++escaped;
+				}
 			}
+
+			return escaped;
+		}
+
+		const Node& root() const {
+			assert(!nodes_.empty());
+			return nodes_.front();
+		}
+
+		std::span<const Node> nodes() const {
+			return nodes_;
+		}
+
+		std::span<const Node> children(const Node& node) const {
+			assert(!node.is_leaf());
+			return std::span<const Node>(nodes_.data() + node.first_child, fanout);
+		}
+
+		Index index(const Node& node) const {
+			return &node - nodes_.data();
+		}
+
+		/* Indices (into the element span) of the items in the subtree of `node`. */
+		std::span<const Index> indices(const Node& node) const {
+			return std::span<const Index>(order_.data() + node.begin, node.size());
+		}
+
+		auto items(const Node& node) const {
+			return indices(node) | std::views::transform([this](Index i) -> const T& {
+				return elements_[i];
+			});
 		}
 
-		bool insert(const T& value) {
-			return root_.insert(value);
+		/* Indices of the elements left out of the tree (outside of its box). */
+		std::span<const Index> outside() const {
+			return outside_;
 		}
 
-		const TNode<T, Dim, Policy>& root() const {
-			return root_;
+		/* Number of items stored in the tree. */
+		std::size_t size() const {
+			return order_.size();
 		}
 
-		TNode<T, Dim, Policy>& root() {
-			return root_;
+		/* Depth of the deepest node of the last build, the root has depth 0. */
+		std::size_t depth() const {
+			return depth_;
 		}
 	};
 
@@ -184,4 +465,4 @@ namespace orthtree {
 	using OctTree = OrthTree<T, 3, P>;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,187 @@
+#ifndef GALAXY_PARALLEL_H
+#define GALAXY_PARALLEL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+
+namespace parallel {
+	/*
+	 * Fixed-size pool of worker threads executing chunked loops.
+	 *
+	 * Work is split into chunks whose boundaries depend only on the problem
+	 * size and the grain, never on the number of threads. Chunks are handed
+	 * out dynamically, but reductions combine the per-chunk results in chunk
+	 * order, so results are bitwise identical for any thread count.
+	 *
+	 * The calling thread takes part in the work. Calls from inside a running
+	 * job are executed serially on the calling worker.
+	 */
+	class ThreadPool {
+	private:
+		std::vector<std::thread> workers_;
+
+		std::mutex mutex_;
+		std::condition_variable wake_;
+		std::condition_variable done_;
+
+		const std::function<void(std::size_t)>* job_ = nullptr;
+		std::size_t chunks_ = 0;
+		std::atomic<std::size_t> next_chunk_ = 0;
+		std::size_t active_ = 0;
+		std::size_t generation_ = 0;
+		bool stop_ = false;
+		std::exception_ptr error_;
+
+		inline static thread_local bool inside_job_ = false;
+
+		void run_chunks() {
+			inside_job_ = true;
+			while (true) {
+				auto chunk = next_chunk_.fetch_add(1, std::memory_order_relaxed);
+				if (chunk >= chunks_) {
+					break;
+				}
+
+				try {
+					(*job_)(chunk);
+				} catch (...) {
+					std::lock_guard lock(mutex_);
+					if (!error_) {
+						error_ = std::current_exception();
+					}
+				}
+			}
+			inside_job_ = false;
+		}
+
+		void worker() {
+			std::size_t seen = 0;
+			while (true) {
+				std::unique_lock lock(mutex_);
+				wake_.wait(lock, [this, seen] { return stop_ || generation_ != seen; });
+				if (stop_) {
+					return;
+				}
+				seen = generation_;
+				lock.unlock();
+
+				run_chunks();
+
+				lock.lock();
+				if (--active_ == 0) {
+					done_.notify_one();
+				}
+			}
+		}
+
+	public:
+		static constexpr std::size_t default_grain = 64;
+
+		explicit ThreadPool(std::size_t threads = 0) {
+			if (threads == 0) {
+				threads = std::max<std::size_t>(1, std::thread::hardware_concurrency());
+			}
+
+			for (std::size_t i = 1; i < threads; ++i) {
+				workers_.emplace_back(&ThreadPool::worker, this);
+			}
+		}
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		~ThreadPool() {
+			{
+				std::lock_guard lock(mutex_);
+				stop_ = true;
+			}
+			wake_.notify_all();
+
+			for (auto&& w : workers_) {
+				w.join();
+			}
+		}
+
+		std::size_t size() const {
+			return workers_.size() + 1;
+		}
+
+		/* Calls `f(chunk)` for every chunk in [0, chunks). */
+		template<typename F>
+		void for_chunks(std::size_t chunks, F&& f) {
+			if (chunks == 0) {
+				return;
+			}
+
+			if (workers_.empty() || chunks == 1 || inside_job_) {
+				for (std::size_t c = 0; c < chunks; ++c) {
+					f(c);
+				}
+				return;
+			}
+
+			const std::function<void(std::size_t)> job = std::ref(f);
+			{
+				std::lock_guard lock(mutex_);
+				job_ = &job;
+				chunks_ = chunks;
+				next_chunk_ = 0;
+				active_ = workers_.size();
+				error_ = nullptr;
+				++generation_;
+			}
+			wake_.notify_all();
+
+			run_chunks();
+
+			std::unique_lock lock(mutex_);
+			done_.wait(lock, [this] { return active_ == 0; });
+			job_ = nullptr;
+
+			if (error_) {
+				std::rethrow_exception(std::exchange(error_, nullptr));
+			}
+		}
+
+		/* Calls `f(begin, end)` over consecutive ranges covering [0, n). */
+		template<typename F>
+		void for_each(std::size_t n, F&& f, std::size_t grain = default_grain) {
+			grain = std::max<std::size_t>(1, grain);
+			for_chunks((n + grain - 1)/grain, [&f, n, grain](std::size_t chunk) {
+				auto begin = chunk*grain;
+				f(begin, std::min(n, begin + grain));
+			});
+		}
+
+		/*
+		 * Calls `f(begin, end)` over consecutive ranges covering [0, n) and sums
+		 * the returned partial results in range order.
+		 */
+		template<typename T, typename F>
+		T reduce(std::size_t n, T init, F&& f, std::size_t grain = default_grain) {
+			grain = std::max<std::size_t>(1, grain);
+			std::vector<T> partial((n + grain - 1)/grain, init);
+
+			for_chunks(partial.size(), [&f, &partial, n, grain](std::size_t chunk) {
+				auto begin = chunk*grain;
+				partial[chunk] = f(begin, std::min(n, begin + grain));
+			});
+
+			T res = init;
+			for (auto&& p : partial) {
+				res += p;
+			}
+			return res;
+		}
+	};
+}
+
+#endif
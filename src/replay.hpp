@@ -0,0 +1,121 @@
+#ifndef GALAXY_REPLAY_H
+#define GALAXY_REPLAY_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include "snapshot.hpp"
+#include "orthtree.hpp"
+#include "spatial.hpp"
+#include "config.hpp"
+
+
+namespace replay {
+	/*
+	 * Snapshot files to replay: `path` itself, or all `.bin` files of the
+	 * directory `path` ordered by name (snapshot names carry zero-padded steps).
+	 */
+	inline std::vector<std::string> frames(const std::string& path) {
+		std::vector<std::string> res;
+		if (std::filesystem::is_directory(path)) {
+			for (auto&& entry : std::filesystem::directory_iterator(path)) {
+				if (entry.is_regular_file() && entry.path().extension() == ".bin") {
+					res.push_back(entry.path().string());
+				}
+			}
+			std::ranges::sort(res);
+		} else {
+			res.push_back(path);
+		}
+
+		if (res.empty()) {
+			throw snapshot::snapshot_error("No snapshots to replay in '" + path + "'.");
+		}
+		return res;
+	}
+
+	/*
+	 * Shows a sequence of snapshots through `Graphics` without running the
+	 * physics, so frames come as fast as the window takes them.
+	 *
+	 * Stands in for the engine passed to Graphics::show(), providing the
+	 * current `bodies` and, for the 2D backends which draw through the tree,
+	 * a quadtree over them. Snapshots are memory mapped and the next one is
+	 * mapped while the current one is shown, so the OS can read it ahead.
+	 */
+	template<typename BodyType, typename Graphics>
+	class Player {
+	public:
+		using Body = BodyType;
+		using Scalar = typename Body::Scalar;
+
+	private:
+		orthtree::OrthTreeItemPolicy<Body> tree_policy;
+
+		using TreeType = orthtree::OrthTree<Body, Body::Dim, orthtree::OrthTreeItemPolicy<Body>>;
+
+		const config::Units& units_;
+
+		std::vector<std::string> paths_;
+		std::size_t frame_ = 0;
+		bool loop_;
+		std::unique_ptr<snapshot::MappedSnapshot> next_;
+
+		TreeType tree_;
+		Graphics graphics_;
+
+	public:
+		spatial::Box<Scalar, Body::Dim> bbox;
+		std::vector<Body> bodies;
+		Scalar time = 0;
+
+		static spatial::Box<Scalar, Body::Dim> init_bbox(config::Config cfg) {
+			std::array<Scalar, Body::Dim> extent = config::get_coords_or_fail<Scalar, Body::Dim>()(cfg, "simulation.size.extent");
+			return spatial::Box<Scalar, Body::Dim>(spatial::Point<Scalar, Body::Dim>(), extent);
+		}
+
+		Player(config::Config cfg, const config::Units& units, std::vector<std::string> paths):
+				units_(units),
+				paths_(std::move(paths)),
+				tree_(tree_policy),
+				graphics_(cfg, units),
+				bbox(init_bbox(cfg))
+		{
+			loop_ = cfg.get<bool>("simulation.replay.loop").value_or(false);
+
+			std::cout << "[replay::Player] Info: Replaying " << paths_.size() << " snapshots." << std::endl;
+			next_ = std::make_unique<snapshot::MappedSnapshot>(paths_[frame_]);
+		}
+
+		/* Shows the next snapshot, returns false after the last one or once the window closes. */
+		bool step() {
+			if (!next_) {
+				return false;
+			}
+
+			bodies = next_->bodies<Body>(units_);
+			time = next_->time(units_);
+
+			++frame_;
+			if (loop_ && frame_ == paths_.size()) {
+				frame_ = 0;
+			}
+			next_.reset();
+			if (frame_ < paths_.size()) {
+				next_ = std::make_unique<snapshot::MappedSnapshot>(paths_[frame_]);
+			}
+
+			if constexpr (Body::Dim == 2) {
+				tree_.build(bbox, bodies);
+			}
+			graphics_.show(time, this, tree_);
+
+			return !graphics_.poll_close();
+		}
+	};
+}
+
+#endif
@@ -3,10 +3,29 @@
 
 #include "mass_distribution.hpp"
 #include "integration.hpp"
-#include "orthtree.hpp"
+#include "diagnostics.hpp"
+#include "barnes_hut.hpp"
+#include "fmm.hpp"
+#include "direct.hpp"
 #include "spatial.hpp"
 #include "config.hpp"
+#include "parallel.hpp"
+#include "utils.hpp"
+#include "snapshot.hpp"
+#include "stats.hpp"
+#include "autotune.hpp"
 #include <utility>
+#include <vector>
+#include <algorithm>
+#include <span>
+#include <cstdint>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <optional>
+#include <numeric>
+#include <type_traits>
 
 #include "graphics/plots.hpp"
 
@@ -49,101 +68,329 @@ namespace simulation {
 	template<typename NumType, bool store_acc = false>
 	using Body3D = Body<NumType, 3, store_acc>;
 
-	template<typename Body, typename Graphics>
-	class TreeSimulationEngine {
+	/*
+	 * Steps the simulation, forces come from `Solver`, which has to provide
+	 * update(bodies, pool), refit(bodies, pool), evaluate(bodies, acc, pool)
+	 * and tree().
+	 */
+	template<typename BodyType, typename Graphics, typename Solver>
+	class SimulationEngine {
 	public:
+		using Body = BodyType;
 		using Scalar = typename Body::Scalar;
 		using Vector = typename Body::Vector;
 		using Point = typename Body::Point;
 		
 	private:
-		struct TreePolicy {
-			using Item = Body;
-			using NumType = typename Body::Scalar;
-			using GetPoint = typename Body::GetPoint;
-
-			static constexpr bool use_accum = true;
-			struct AccumType {
-				std::size_t count = 0;
-				Vector pos_sum;
-
-				Scalar total_mass = 0;
-
-				Point center_of_mass() const {
-					return pos_sum/(Scalar)count;
-				}
-			};
-			struct Accum {
-				void operator()(AccumType& cur, const Body& body) const {
-					cur.count += 1;
-					cur.pos_sum += body.pos;
-					cur.total_mass += body.mass;
-				}
-			};
+		config::Config cfg_;
+		const config::Units& units_;
 
-			std::size_t node_capacity = 1;
-		} tree_policy;
-		using TreeType = orthtree::OrthTree<Body, Body::Dim, TreePolicy>;
+		Solver solver_;
+		std::vector<Vector> accelerations_;
 		
-		integration::IntegrationMethod<Body> integration_;
+		integration::Method<Body> integration_;
 		Graphics graphics_;
 
 		bool plot_energy_;
 
-		std::pair<Vector, Scalar> interact(const Body& body, const Point& other_pos, Scalar other_mass) const {
-			auto diff = body.pos - other_pos;
+		parallel::ThreadPool pool_;
 
-			auto dist = diff.norm();
-			auto smoothed = std::sqrt(dist*dist + eps*eps);
+		Scalar pot_energy_ = 0;
 
-			auto acc = -G * other_mass * diff / std::pow(smoothed, (Scalar)3);
-			auto pot = -G * body.mass * other_mass / smoothed / 2;
+		std::size_t stats_interval_;
+		std::size_t step_count_ = 0;
+		std::size_t last_report_step_ = 0;
+		std::chrono::steady_clock::time_point last_report_;
+
+		stats::Recorder stats_;
+		diagnostics::Log diagnostics_;
+
+		/* Solvers with an opening angle and leaf capacity, see autotune::Tuner. */
+		static constexpr bool tunable = requires(Solver& s) {
+			s.theta;
+			s.set_leaf_capacity(std::size_t());
+		};
+		std::optional<autotune::Tuner> tuner_;
+
+		std::size_t max_rung_;
+		Scalar eta_;
+		std::vector<std::uint8_t> rungs_;
+		std::vector<char> active_;
+
+		/* Jerks, only for integration methods which need them. */
+		static constexpr bool has_jerk = requires(Solver& s, std::vector<Body>& b, std::vector<Vector>& v, parallel::ThreadPool& p) {
+			s.evaluate_jerk(b, v, v, p);
+		};
+		bool needs_jerk_;
+		std::vector<Vector> jerks_;
+
+		bool adaptive_;
+		Scalar tolerance_;
+		Scalar step_dt_;
+		Scalar next_dt_;
+		/* State at the start of an adaptive step, and the original index of every body since then. */
+		std::vector<Body> start_bodies_;
+		std::vector<Vector> start_acc_;
+		std::vector<Vector> start_jerks_;
+		std::vector<std::size_t> origin_;
+		/* Positions of step doubling, see step_adaptive(). */
+		std::vector<Point> whole_;
+		std::vector<Point> other_;
+		std::vector<Point> from_;
+
+		void report(Scalar pot_energy) {
+			auto now = std::chrono::steady_clock::now();
+			auto time_unit = units_.unit(config::Units::Quantity::TIME);
+			auto kin_energy = kinetic_energy();
+
+			std::cout << "[simulation::SimulationEngine] Info: step " << step_count_
+				<< ", time " << formatf(time*time_unit.value, 2) << " " << time_unit.unit
+				<< ", energy " << kin_energy + pot_energy
+				<< " (kinetic " << kin_energy << ", potential " << pot_energy << ")";
+			if (adaptive_) {
+				std::cout << ", dt " << step_dt_*time_unit.value << " " << time_unit.unit;
+			}
+			if (step_count_ > last_report_step_) {
+				std::chrono::duration<double> elapsed = now - last_report_;
+				std::cout << ", " << formatf((step_count_ - last_report_step_) / elapsed.count(), 1) << " steps/s";
+			}
+			std::cout << std::endl;
 
-			return std::make_pair(acc, pot);
+			auto summary = stats_.summary();
+			if (!summary.empty()) {
+				std::cout << "[simulation::SimulationEngine] Info: " << summary << std::endl;
+			}
+
+			last_report_ = now;
+			last_report_step_ = step_count_;
+		}
+
+		/* Per-body state follows the bodies reordered by the solver. */
+		template<typename Index>
+		void permute_state(std::span<const Index> permutation) {
+			if (!permutation.empty()) {
+				integration::permute(accelerations_, permutation);
+				integration::permute(jerks_, permutation);
+				integration::permute(rungs_, permutation);
+			}
 		}
 
-		std::pair<Vector, Scalar> traverse(const Body& body, typename TreeType::Node* node) const {
-			Vector res_acc;
-			Scalar res_pot = 0.;
+		/*
+		 * Updates the solver, per-body state follows the bodies if they get
+		 * reordered. Returns the permutation, empty if there was none.
+		 */
+		auto update_solver() {
+			auto timer = stats_.time(stats::Phase::BUILD);
+
+			auto permutation = solver_.update(bodies, pool_);
+			stats_.depth(solver_.tree().depth());
+			permute_state(permutation);
+			return permutation;
+		}
 
-			auto mc = node->accum_value.center_of_mass();
-			auto d = (body.pos-mc).norm();
+		/* Refits the solver to the moved bodies, it rebuilds itself only if they moved too far. */
+		void refit_solver() {
+			auto timer = stats_.time(stats::Phase::BUILD);
 
-			if (node->bbox.s() < theta*d) {
-				//assert(!node->bbox.contains(body.pos));
-				auto [acc, pot] = interact(body, mc, node->accum_value.total_mass);
-				res_acc += acc;
-				res_pot += pot;
-			} else {
-				if (node->is_leaf()) {
-					for (auto&& other : node->data) {
-						auto [acc, pot] = interact(body, other.pos, other.mass);
-						res_acc += acc;
-						res_pot += pot;
+			permute_state(solver_.refit(bodies, pool_));
+			stats_.depth(solver_.tree().depth());
+		}
+
+		/* Accelerations (and jerks) and potential energy for the current positions. */
+		auto evaluate_forces() {
+			auto permutation = update_solver();
+
+			accelerations_.resize(bodies.size());
+			auto timer = stats_.time(stats::Phase::TRAVERSAL);
+			if constexpr (has_jerk) {
+				if (needs_jerk_) {
+					jerks_.resize(bodies.size());
+					pot_energy_ = solver_.evaluate_jerk(bodies, accelerations_, jerks_, pool_);
+					return permutation;
+				}
+			}
+			pot_energy_ = solver_.evaluate(bodies, accelerations_, pool_);
+			return permutation;
+		}
+
+		/* Advances all bodies by `h` with `method`, `origin_` follows the bodies if they get reordered. */
+		template<typename Method>
+		void advance(Method& method, Scalar h) {
+			method.step(bodies, accelerations_, jerks_, h, pool_, [this] {
+				auto permutation = evaluate_forces();
+				integration::permute(origin_, permutation);
+				return permutation;
+			});
+		}
+
+		/* Returns to the state saved at the start of an adaptive step. */
+		void restore_start() {
+			bodies = start_bodies_;
+			accelerations_ = start_acc_;
+			jerks_ = start_jerks_;
+			origin_.resize(bodies.size());
+			std::iota(origin_.begin(), origin_.end(), std::size_t(0));
+		}
+
+		/*
+		 * Adaptive global step with error control. Hermite estimates the error
+		 * by its corrections of the predicted positions, the other methods by
+		 * step doubling: the step is taken once whole and once in two halves,
+		 * which are kept. The error is the largest position difference relative
+		 * to the distance moved, at least eps (see integration::position_error()).
+		 *
+		 * A step with an error above `tolerance_` is taken again shorter. The
+		 * next step is scaled towards the tolerance by the error order of the
+		 * method, by at most 2 and up to dt. Steps of dt/2^16 are always kept.
+		 */
+		void step_adaptive() {
+			start_bodies_ = bodies;
+			start_acc_ = accelerations_;
+			start_jerks_ = jerks_;
+			origin_.resize(bodies.size());
+			std::iota(origin_.begin(), origin_.end(), std::size_t(0));
+
+			auto h = next_dt_;
+			while (true) {
+				Scalar error = 0;
+				int order = 1;
+				std::visit([this, h, &error, &order](auto& method) {
+					using Method = std::decay_t<decltype(method)>;
+					order = Method::error_order;
+
+					advance(method, h);
+					if constexpr (requires { method.error(bodies, eps, pool_); }) {
+						error = method.error(bodies, eps, pool_);
+					} else {
+						whole_.resize(bodies.size());
+						for (std::size_t i = 0; i < bodies.size(); ++i) {
+							whole_[origin_[i]] = bodies[i].pos;
+						}
+
+						restore_start();
+						advance(method, h/2);
+						if constexpr (!Method::evaluates_forces) {
+							integration::permute(origin_, evaluate_forces());
+						}
+						advance(method, h/2);
+
+						// Both in the order of the bodies now
+						other_.resize(bodies.size());
+						from_.resize(bodies.size());
+						for (std::size_t i = 0; i < bodies.size(); ++i) {
+							other_[i] = whole_[origin_[i]];
+							from_[i] = start_bodies_[origin_[i]].pos;
+						}
+						error = integration::position_error(bodies, other_, from_, eps, pool_);
 					}
+				}, integration_);
+
+				auto factor = error > 0 ? Scalar(0.9)*std::pow(tolerance_/error, Scalar(1)/order) : Scalar(2);
+				factor = std::clamp(factor, Scalar(0.2), Scalar(2));
+				if (error <= tolerance_ || h <= dt/65536) {
+					step_dt_ = h;
+					next_dt_ = std::min(dt, h*factor);
+					return;
+				}
+
+				restore_start();
+				h *= factor;
+			}
+		}
+
+		/* Rung of the step dt_i = sqrt(2 eta eps / |a|), the largest step dt/2^r <= dt_i. */
+		std::uint8_t rung_for(const Vector& acc) const {
+			auto a = acc.norm();
+			if (a == 0) {
+				return 0;
+			}
+
+			auto dt_i = std::sqrt(2*eta_*eps/a);
+			if (dt_i >= dt) {
+				return 0;
+			}
+			return std::min<std::size_t>(max_rung_, std::ceil(std::log2(dt/dt_i)));
+		}
+
+		/*
+		 * Rung of a body finishing its step at tick `tick`. Moving to a smaller
+		 * rung is possible only where its steps start.
+		 */
+		std::uint8_t next_rung(std::uint8_t rung, const Vector& acc, std::size_t tick) const {
+			auto target = rung_for(acc);
+			if (target >= rung) {
+				return target;
+			}
+
+			auto ticks = std::size_t(1) << max_rung_;
+			while (rung > target && tick % (ticks >> (rung - 1)) == 0) {
+				--rung;
+			}
+			return rung;
+		}
+
+		/*
+		 * Advances bodies by `dt` with hierarchical block timesteps.
+		 *
+		 * A body on rung r takes kick-drift-kick leapfrog steps of dt/2^r. All
+		 * bodies drift every tick (dt/2^max_rung), forces are recomputed only
+		 * for the bodies finishing their step, which then get a new rung. At the
+		 * end all bodies are synchronized again.
+		 *
+		 * The solver is updated (rebuilt as configured) only at the end, where
+		 * all bodies are synchronized, other ticks refit it, which rebuilds
+		 * only once more than `max_escaped` of the bodies left their leaves.
+		 */
+		void step_blocks() {
+			auto ticks = std::size_t(1) << max_rung_;
+			auto tick = dt / ticks;
+			auto length = [&](std::size_t i) {
+				return ticks >> rungs_[i];
+			};
+
+			for (std::size_t t = 0; t < ticks; ++t) {
+				{
+					auto timer = stats_.time(stats::Phase::INTEGRATION);
+					pool_.for_each(bodies.size(), [&](std::size_t begin, std::size_t end) {
+						for (std::size_t i = begin; i < end; ++i) {
+							if (t % length(i) == 0) {
+								bodies[i].vel += accelerations_[i] * (length(i)*tick/2);
+							}
+							bodies[i].pos += bodies[i].vel * tick;
+						}
+					}, 4096);
+				}
+
+				if (t + 1 == ticks) {
+					update_solver();
 				} else {
-					for (auto&& child : *(node->children)) {
-						auto [acc, pot] = traverse(body, child.get());
-						res_acc += acc;
-						res_pot += pot;
+					refit_solver();
+				}
+
+				active_.resize(bodies.size());
+				for (std::size_t i = 0; i < bodies.size(); ++i) {
+					active_[i] = (t + 1) % length(i) == 0;
+				}
+
+				{
+					auto timer = stats_.time(stats::Phase::TRAVERSAL);
+					if (t + 1 == ticks) {
+						pot_energy_ = solver_.evaluate(bodies, accelerations_, pool_);
+					} else {
+						solver_.evaluate_active(bodies, active_, accelerations_, pool_);
 					}
-					/*std::vector<std::pair<Vector, Scalar>> res(node->children.value().size());
-					std::transform(
-						std::execution::par, 
-						node->children.value().begin(), node->children.value().end(),
-						res.begin(),
-						[this, &body](auto&& child) {
-							return traverse(body, child.get());
-						}
-					);
-					for (auto&& [acc, pot] : res) {
-						res_acc += acc;
-						res_pot += pot;
-					}*/
 				}
-			}
 
-			return std::make_pair(res_acc, res_pot);
+				auto timer = stats_.time(stats::Phase::INTEGRATION);
+				pool_.for_each(bodies.size(), [&](std::size_t begin, std::size_t end) {
+					for (std::size_t i = begin; i < end; ++i) {
+						if (active_[i]) {
+							bodies[i].vel += accelerations_[i] * (length(i)*tick/2);
+							rungs_[i] = next_rung(rungs_[i], accelerations_[i], t + 1);
+						}
+					}
+				}, 4096);
+			}
 		}
 
 	public:
@@ -152,7 +399,6 @@ namespace simulation {
 		Scalar time = 0;
 
 		Scalar dt;
-		Scalar theta;
 		Scalar eps;
 		Scalar G;
 
@@ -165,23 +411,124 @@ namespace simulation {
 			return spatial::Box<Scalar, Body::Dim>(center, extent);
 		}
 
-		TreeSimulationEngine(config::Config cfg, const config::Units& units, integration::IntegrationMethod<Body> intm, mass_distribution::MassDistribution<Body, TreeSimulationEngine<Body, Graphics>> mdist): 
+	private:
+		SimulationEngine(config::Config cfg, const config::Units& units, integration::Method<Body> intm):
+				cfg_(cfg),
+				units_(units),
+				solver_(cfg, units, init_bbox(cfg)),
 				integration_(intm), 
 				graphics_(cfg, units),
+				pool_(cfg.get<std::size_t>("simulation.engine.threads").value_or(0)),
+				stats_(cfg),
+				diagnostics_(cfg),
 				bbox(init_bbox(cfg)),
 				energy(cfg)
 		{
-			plot_energy_ = cfg.get<bool>("simulation.plots.energy.enable").value_or(true);
+			// Graphics running on their own thread plot the energy there
+			constexpr bool graphics_plot = requires { Graphics::plots_energy; };
+			plot_energy_ = !Graphics::headless && !graphics_plot && cfg.get<bool>("simulation.plots.energy.enable").value_or(true);
+			stats_interval_ = cfg.get<std::size_t>("simulation.stats.interval").value_or(Graphics::headless ? 100 : 0);
 
-			G = units.G();
-			theta = cfg.get_or_fail<Scalar>("simulation.engine.theta");
-			eps = cfg.get_or_fail<Scalar>("simulation.engine.eps");
+			G = solver_.G;
+			eps = solver_.eps;
 
 			dt = cfg.get_or_fail<Scalar>("simulation.integration.dt");
+			step_dt_ = dt;
+			next_dt_ = dt;
+
+			if (cfg.get<bool>("simulation.engine.autotune.enable").value_or(false)) {
+				if constexpr (tunable) {
+					tuner_.emplace(cfg);
+				} else {
+					std::cout << "[simulation::SimulationEngine] Warning: The engine has nothing to tune, simulation.engine.autotune is ignored." << std::endl;
+				}
+			}
+
+			max_rung_ = cfg.get<std::size_t>("simulation.integration.max_rung").value_or(0);
+			eta_ = cfg.get<Scalar>("simulation.integration.eta").value_or(0.025);
+			if (max_rung_ > 16) {
+				throw config::configuration_error("Too many timestep rungs.");
+			}
+			if (max_rung_ > 0) {
+				std::cout << "[simulation::SimulationEngine] Info: Block timesteps use kick-drift-kick leapfrog, simulation.integration.type is ignored." << std::endl;
+			}
 
+			needs_jerk_ = max_rung_ == 0 && integration::needs_jerk(integration_);
+			if (needs_jerk_ && !has_jerk) {
+				throw config::configuration_error("Integration type needs jerks, which the selected engine does not compute.");
+			}
+			if constexpr (requires { solver_.theta; }) {
+				if (needs_jerk_ && solver_.theta > 0.5) {
+					std::cout << "[simulation::SimulationEngine] Warning: Jerks of accepted tree nodes are monopole approximations, with theta " << solver_.theta << " they are inaccurate." << std::endl;
+				}
+			}
+
+			adaptive_ = cfg.get<bool>("simulation.integration.adaptive").value_or(false);
+			tolerance_ = cfg.get<Scalar>("simulation.integration.tolerance").value_or(1e-4);
+			if (adaptive_ && !(tolerance_ > 0)) {
+				throw config::configuration_error("Adaptive steps need a positive tolerance.");
+			}
+			if (adaptive_ && max_rung_ > 0) {
+				std::cout << "[simulation::SimulationEngine] Info: Block timesteps choose their own steps, simulation.integration.adaptive is ignored." << std::endl;
+				adaptive_ = false;
+			}
+		}
+
+	public:
+		SimulationEngine(config::Config cfg, const config::Units& units, integration::Method<Body> intm, mass_distribution::MassDistribution<Body, SimulationEngine<Body, Graphics, Solver>> mdist):
+				SimulationEngine(cfg, units, intm)
+		{
 			mdist(cfg.get_or_fail("simulation.mass_distribution"), this);
 		}
 
+		/*
+		 * Continues a simulation from a snapshot. Block timestep rungs, the next
+		 * adaptive step and the refit state of the tree are not stored, the
+		 * first step assigns the rungs, tries dt and builds the tree again. The
+		 * run continues bitwise identically only without block timesteps and
+		 * adaptive steps, and with `rebuild_interval` = 1.
+		 */
+		SimulationEngine(config::Config cfg, const config::Units& units, integration::Method<Body> intm, const snapshot::Snapshot& snap):
+				SimulationEngine(cfg, units, intm)
+		{
+			auto snap_G = snap.G(units);
+			if (std::abs(snap_G - G) > 1e-9*std::abs(G)) {
+				std::stringstream ss;
+				ss << "The snapshot was simulated with G = " << snap_G << " (in the configured units), the configuration gives " << G << ".";
+				throw config::configuration_error(ss.str());
+			}
+
+			bodies = snap.bodies<Body>(units);
+			time = snap.time(units);
+			step_count_ = snap.header.step;
+			last_report_step_ = step_count_;
+
+			std::cout << "[simulation::SimulationEngine] Info: Restarted " << bodies.size() << " bodies at step " << step_count_ << "." << std::endl;
+		}
+
+		/* State of the simulation between two steps. */
+		snapshot::Snapshot snapshot() const {
+			return snapshot::Snapshot::capture(bodies, step_count_, time, dt, units_);
+		}
+
+		Scalar kinetic_energy() const {
+			Scalar kin_energy = 0.;
+			for (std::size_t i = 0; i < bodies.size(); ++i) {
+				kin_energy += 0.5 * bodies[i].mass * bodies[i].vel.norm_squared();
+			}
+			return kin_energy;
+		}
+
+		/* Potential energy of the bodies as of the last force evaluation. */
+		Scalar potential_energy() const {
+			return pot_energy_;
+		}
+
+		/* Number of steps done since the start of the simulation. */
+		std::size_t steps() const {
+			return step_count_;
+		}
+
 		static void velocity_initialization(Body& body, const Vector& acc) {
 			Scalar a = acc.norm();
 
@@ -200,54 +547,113 @@ namespace simulation {
 			body.vel[1] = v_t*std::sin(theta - std::numbers::pi/2) + v_r*std::sin(theta);
 		}
 
+		/* Initializes velocities of bodies in [begin, end) from the field of these bodies only. May reorder them. */
 		void init_vels(typename std::vector<Body>::iterator begin, typename std::vector<Body>::iterator end) {
-			TreeType tree(tree_policy, bbox, begin, end);
+			std::vector<Body> subset(begin, end);
+			std::vector<Vector> acc(subset.size());
 
-			for (auto it = begin; it != end; ++it) {
-				auto [acc, _] = traverse(*it, &tree.root());
-				velocity_initialization(*it, acc);
-			}
+			Solver solver(cfg_, units_, bbox);
+			solver.update(subset, pool_);
+			solver.evaluate(subset, acc, pool_);
+
+			pool_.for_each(subset.size(), [&](std::size_t first, std::size_t last) {
+				for (std::size_t i = first; i < last; ++i) {
+					velocity_initialization(subset[i], acc[i]);
+					begin[i] = subset[i];
+				}
+			}, 4096);
+		}
+
+		/* Worker threads of the engine, also used to generate the initial conditions. */
+		parallel::ThreadPool& pool() {
+			return pool_;
 		}
 
 		bool step() {
-			TreeType tree(tree_policy, bbox, bodies);
+			if constexpr (tunable) {
+				if (tuner_ && tuner_->due(step_count_) && !bodies.empty()) {
+					auto res = tuner_->template tune<Solver>(cfg_, units_, bbox, bodies, pool_);
+					solver_.theta = res.theta;
+					solver_.set_leaf_capacity(res.leaf_capacity);
+				}
+			}
 
-			// Calculate accelerations
-			std::vector<Vector> accelerations;
-			Scalar pot_energy = 0.;
-			for (auto&& body : bodies) {
-				auto [acc, pot] = traverse(body, &tree.root());
-				pot_energy += pot;
-				accelerations.push_back(acc);
+			// Calculate accelerations, block timesteps and leapfrog keep them from the end of the previous step
+			bool carried = max_rung_ > 0 ? rungs_.size() == bodies.size() : integration::evaluates_forces(integration_) && accelerations_.size() == bodies.size() && (!needs_jerk_ || jerks_.size() == bodies.size());
+			if (!carried) {
+				evaluate_forces();
+
+				if (max_rung_ > 0) {
+					rungs_.resize(bodies.size());
+					for (std::size_t i = 0; i < bodies.size(); ++i) {
+						rungs_[i] = rung_for(accelerations_[i]);
+					}
+				}
 			}
+			Scalar pot_energy = pot_energy_;
 
 			// Do graphics
-			if (plot_energy_) {
-				Scalar kin_energy = 0.;
+			{
+				auto timer = stats_.time(stats::Phase::ENERGY);
+				if (plot_energy_ && energy.due(step_count_)) {
+					energy.log(kinetic_energy(), pot_energy);
+					energy.show();
+				}
 
-				for (std::size_t i = 0; i < bodies.size(); ++i) {
-					kin_energy += 0.5 * bodies[i].mass * bodies[i].vel.norm_squared();
+				if (diagnostics_.due(step_count_)) {
+					auto sample = diagnostics::measure(bodies, pot_energy, pool_);
+					sample.step = step_count_;
+					sample.time = time;
+					diagnostics_.write(sample);
 				}
 
-				energy.log(kin_energy, pot_energy);
-				energy.show();
+				if (stats_interval_ > 0 && step_count_ % stats_interval_ == 0) {
+					report(pot_energy);
+				}
 			}
 
-			graphics_.show(time, this, tree);
+			{
+				auto timer = stats_.time(stats::Phase::RENDER);
+				graphics_.show(time, this, solver_.tree());
+			}
 
 			if (graphics_.poll_close()) {
 				return false;
 			}
 
 			// Integrate
-			for (std::size_t i = 0; i < bodies.size(); ++i) {
-				integration_(bodies[i], dt, accelerations[i]);
+			if (max_rung_ == 0 && adaptive_) {
+				auto timer = stats_.time(stats::Phase::INTEGRATION);
+				step_adaptive();
+			} else if (max_rung_ == 0) {
+				step_dt_ = dt;
+
+				auto timer = stats_.time(stats::Phase::INTEGRATION);
+				std::visit([this](auto& method) {
+					method.step(bodies, accelerations_, jerks_, step_dt_, pool_, [this] {
+						return evaluate_forces();
+					});
+				}, integration_);
+			} else {
+				step_blocks();
 			}
-			time += dt;
+			stats_.end_step(step_count_);
+
+			time += step_dt_;
+			++step_count_;
 
 			return true;
 		}
 	};
+
+	template<typename Body, typename Graphics, std::size_t Order = 1>
+	using TreeSimulationEngine = SimulationEngine<Body, Graphics, barnes_hut::Solver<Body, Order>>;
+
+	template<typename Body, typename Graphics>
+	using FMMSimulationEngine = SimulationEngine<Body, Graphics, fmm::Solver<Body>>;
+
+	template<typename Body, typename Graphics>
+	using DirectSimulationEngine = SimulationEngine<Body, Graphics, direct::Solver<Body>>;
 }
 
 #endif
\ No newline at end of file
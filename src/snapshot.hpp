@@ -0,0 +1,484 @@
+#ifndef GALAXY_SNAPSHOT_H
+#define GALAXY_SNAPSHOT_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <array>
+#include <deque>
+#include <fstream>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <algorithm>
+#include <type_traits>
+#include <iostream>
+#include <span>
+#include <cstddef>
+#include <cmath>
+#include "config.hpp"
+#include "spatial.hpp"
+
+#if defined(_WIN32)
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+
+namespace snapshot {
+	class snapshot_error : public std::runtime_error
+	{
+	public:
+		snapshot_error(const std::string& msg): std::runtime_error(msg) {};
+		snapshot_error(std::string&& msg): std::runtime_error(msg) {};
+	};
+
+	/*
+	 * Binary snapshot layout, all values in the byte order of the writing
+	 * machine (checked through `byte_order` when reading):
+	 *
+	 *   Header
+	 *   double pos[dim][count]   (positions, one block per coordinate)
+	 *   double vel[dim][count]   (velocities, one block per coordinate)
+	 *   double mass[count]
+	 *
+	 * Values are in simulation units, `units` holds their size in SI units
+	 * (distance, time, mass), so a snapshot can be restarted with different
+	 * units.
+	 */
+	struct Header {
+		static constexpr std::array<char, 8> MAGIC = {'G', 'A', 'L', 'A', 'X', 'Y', 'S', 'N'};
+		static constexpr std::uint32_t VERSION = 1;
+		static constexpr std::uint32_t ORDER_MARK = 0x01020304;
+
+		std::array<char, 8> magic = MAGIC;
+		std::uint32_t version = VERSION;
+		std::uint32_t byte_order = ORDER_MARK;
+
+		std::uint32_t dim = 0;
+		std::uint32_t scalar_size = sizeof(double);
+
+		std::uint64_t step = 0;
+		std::uint64_t count = 0;
+
+		double time = 0;
+		double dt = 0;
+		std::array<double, 3> units = {};
+		double G = 0;
+	};
+	static_assert(std::is_trivially_copyable_v<Header>);
+	static_assert(sizeof(Header) % alignof(double) == 0, "Blocks following the header have to stay aligned.");
+
+	/* Size of the whole snapshot file described by `header`. */
+	inline std::size_t file_size(const Header& header) {
+		return sizeof(Header) + (2*header.dim + 1)*header.count*sizeof(double);
+	}
+
+	inline void check(const Header& header, const std::string& path) {
+		if (header.magic != Header::MAGIC) {
+			throw snapshot_error("'" + path + "' is not a snapshot.");
+		}
+		if (header.byte_order != Header::ORDER_MARK) {
+			throw snapshot_error("Snapshot '" + path + "' was written with a different byte order.");
+		}
+		if (header.version != Header::VERSION || header.scalar_size != sizeof(double)) {
+			throw snapshot_error("Unsupported snapshot version " + std::to_string(header.version) + ".");
+		}
+
+		// Untrusted sizes, file_size() must not overflow
+		if (header.dim != 2 && header.dim != 3) {
+			throw snapshot_error("Snapshot '" + path + "' has invalid dimension " + std::to_string(header.dim) + ".");
+		}
+		if (header.count > (SIZE_MAX - sizeof(Header)) / ((2*header.dim + 1)*sizeof(double))) {
+			throw snapshot_error("Snapshot '" + path + "' has invalid body count " + std::to_string(header.count) + ".");
+		}
+	}
+
+	/*
+	 * Conversions shared by snapshots in memory and mapped ones, `Derived`
+	 * provides the header and pos(d), vel(d), mass() spans.
+	 */
+	template<typename Derived>
+	struct Contents {
+		/*
+		 * Bodies of the snapshot converted to `units`. Velocities are set as
+		 * they were, accelerations (if stored) are left zero.
+		 */
+		template<typename Body>
+		std::vector<Body> bodies(const config::Units& units) const {
+			auto& self = static_cast<const Derived&>(*this);
+			auto& header = self.header;
+			if (header.dim != Body::Dim) {
+				throw snapshot_error("Snapshot dimension " + std::to_string(header.dim) + " does not match the simulation.");
+			}
+
+			auto dist = unit_ratio(units, 0);
+			auto speed = dist / unit_ratio(units, 1);
+			auto mass_ratio = unit_ratio(units, 2);
+
+			auto mass = self.mass();
+
+			std::vector<Body> res;
+			res.reserve(header.count);
+			for (std::size_t i = 0; i < header.count; ++i) {
+				typename Body::Point p;
+				typename Body::Vector v;
+				for (std::size_t d = 0; d < Body::Dim; ++d) {
+					p[d] = self.pos(d)[i] * dist;
+					v[d] = self.vel(d)[i] * speed;
+				}
+				res.emplace_back(p, v, mass[i] * mass_ratio);
+			}
+			return res;
+		}
+
+		/* Time of the snapshot in `units`. */
+		double time(const config::Units& units) const {
+			return static_cast<const Derived&>(*this).header.time * unit_ratio(units, 1);
+		}
+
+		/* Gravitational constant of the snapshot in `units`, G ~ dist^3/(mass time^2). */
+		double G(const config::Units& units) const {
+			auto dist = unit_ratio(units, 0);
+			return static_cast<const Derived&>(*this).header.G * dist*dist*dist / (unit_ratio(units, 2) * std::pow(unit_ratio(units, 1), 2));
+		}
+
+		/* Size of the stored unit of `Units::quantities[q]` in `units`. */
+		double unit_ratio(const config::Units& units, std::size_t q) const {
+			return static_cast<const Derived&>(*this).header.units[q] / units.base_unit(config::Units::quantities[q]);
+		}
+	};
+
+	/* State of a simulation between two steps, bodies stored as structure of arrays. */
+	struct Snapshot : public Contents<Snapshot> {
+		Header header;
+
+		std::vector<std::vector<double>> positions;
+		std::vector<std::vector<double>> velocities;
+		std::vector<double> masses;
+
+		std::span<const double> pos(std::size_t d) const {
+			return positions[d];
+		}
+
+		std::span<const double> vel(std::size_t d) const {
+			return velocities[d];
+		}
+
+		std::span<const double> mass() const {
+			return masses;
+		}
+
+		template<typename Body>
+		static Snapshot capture(const std::vector<Body>& bodies, std::size_t step, double time, double dt, const config::Units& units) {
+			Snapshot res;
+			res.header.dim = Body::Dim;
+			res.header.step = step;
+			res.header.count = bodies.size();
+			res.header.time = time;
+			res.header.dt = dt;
+			for (std::size_t q = 0; q < config::Units::quantities.size(); ++q) {
+				res.header.units[q] = units.base_unit(config::Units::quantities[q]);
+			}
+			res.header.G = units.G();
+
+			res.positions.assign(Body::Dim, std::vector<double>(bodies.size()));
+			res.velocities.assign(Body::Dim, std::vector<double>(bodies.size()));
+			res.masses.resize(bodies.size());
+			for (std::size_t i = 0; i < bodies.size(); ++i) {
+				for (std::size_t d = 0; d < Body::Dim; ++d) {
+					res.positions[d][i] = bodies[i].pos[d];
+					res.velocities[d][i] = bodies[i].vel[d];
+				}
+				res.masses[i] = bodies[i].mass;
+			}
+			return res;
+		}
+	};
+
+	/*
+	 * Writes `snap` to `path`. The data go to a temporary file first, which
+	 * is then renamed, so an interrupted write never replaces a good
+	 * snapshot with a truncated one.
+	 */
+	inline void write(const Snapshot& snap, const std::string& path) {
+		auto tmp = path + ".tmp";
+		{
+			std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+			if (!out) {
+				throw snapshot_error("Unable to open '" + tmp + "' for writing.");
+			}
+
+			auto block = [&](const std::vector<double>& values) {
+				out.write(reinterpret_cast<const char*>(values.data()), values.size()*sizeof(double));
+			};
+
+			out.write(reinterpret_cast<const char*>(&snap.header), sizeof(Header));
+			for (auto&& p : snap.positions) {
+				block(p);
+			}
+			for (auto&& v : snap.velocities) {
+				block(v);
+			}
+			block(snap.masses);
+
+			out.flush();
+			if (!out) {
+				throw snapshot_error("Unable to write snapshot '" + tmp + "'.");
+			}
+		}
+		std::filesystem::rename(tmp, path);
+	}
+
+	inline Snapshot read(const std::string& path) {
+		std::ifstream in(path, std::ios::binary);
+		if (!in) {
+			throw snapshot_error("Unable to open snapshot '" + path + "'.");
+		}
+
+		Snapshot snap;
+		in.read(reinterpret_cast<char*>(&snap.header), sizeof(Header));
+		auto& h = snap.header;
+		if (!in) {
+			throw snapshot_error("'" + path + "' is not a snapshot.");
+		}
+		check(h, path);
+
+		auto block = [&](std::vector<double>& values) {
+			values.resize(h.count);
+			in.read(reinterpret_cast<char*>(values.data()), values.size()*sizeof(double));
+		};
+
+		snap.positions.resize(h.dim);
+		snap.velocities.resize(h.dim);
+		for (auto& p : snap.positions) {
+			block(p);
+		}
+		for (auto& v : snap.velocities) {
+			block(v);
+		}
+		block(snap.masses);
+
+		if (!in) {
+			throw snapshot_error("Snapshot '" + path + "' is truncated.");
+		}
+		return snap;
+	}
+
+	/*
+	 * Read-only memory mapping of a snapshot file, the blocks are accessed
+	 * in place without parsing or copying. Pages are loaded by the OS as
+	 * they are touched, so opening even a large snapshot is cheap.
+	 */
+	class MappedSnapshot : public Contents<MappedSnapshot> {
+	private:
+		const std::byte* data_ = nullptr;
+		std::size_t size_ = 0;
+
+	#if defined(_WIN32)
+		HANDLE file_ = INVALID_HANDLE_VALUE;
+		HANDLE mapping_ = nullptr;
+	#endif
+
+		void map(const std::string& path) {
+		#if defined(_WIN32)
+			file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (file_ == INVALID_HANDLE_VALUE) {
+				throw snapshot_error("Unable to open snapshot '" + path + "'.");
+			}
+			LARGE_INTEGER size;
+			GetFileSizeEx(file_, &size);
+			size_ = size.QuadPart;
+			if (size_ < sizeof(Header)) {
+				throw snapshot_error("'" + path + "' is not a snapshot.");
+			}
+
+			mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			auto view = mapping_ ? MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0) : nullptr;
+			if (!view) {
+				throw snapshot_error("Unable to map snapshot '" + path + "'.");
+			}
+			data_ = static_cast<const std::byte*>(view);
+		#else
+			int fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0) {
+				throw snapshot_error("Unable to open snapshot '" + path + "'.");
+			}
+
+			struct stat st;
+			if (::fstat(fd, &st) != 0 || std::size_t(st.st_size) < sizeof(Header)) {
+				::close(fd);
+				throw snapshot_error("'" + path + "' is not a snapshot.");
+			}
+			size_ = st.st_size;
+
+			auto view = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+			::close(fd);
+			if (view == MAP_FAILED) {
+				throw snapshot_error("Unable to map snapshot '" + path + "'.");
+			}
+			::madvise(view, size_, MADV_WILLNEED);
+			data_ = static_cast<const std::byte*>(view);
+		#endif
+		}
+
+		void unmap() {
+		#if defined(_WIN32)
+			if (data_) {
+				UnmapViewOfFile(data_);
+			}
+			if (mapping_) {
+				CloseHandle(mapping_);
+			}
+			if (file_ != INVALID_HANDLE_VALUE) {
+				CloseHandle(file_);
+			}
+			file_ = INVALID_HANDLE_VALUE;
+			mapping_ = nullptr;
+		#else
+			if (data_) {
+				::munmap(const_cast<std::byte*>(data_), size_);
+			}
+		#endif
+			data_ = nullptr;
+			size_ = 0;
+		}
+
+		std::span<const double> block(std::size_t idx) const {
+			auto begin = reinterpret_cast<const double*>(data_ + sizeof(Header)) + idx*header.count;
+			return std::span<const double>(begin, header.count);
+		}
+
+	public:
+		Header header;
+
+		MappedSnapshot(const std::string& path) {
+			try {
+				map(path);
+
+				std::memcpy(&header, data_, sizeof(Header));
+				check(header, path);
+				if (size_ < file_size(header)) {
+					throw snapshot_error("Snapshot '" + path + "' is truncated.");
+				}
+			} catch (...) {
+				unmap();
+				throw;
+			}
+		}
+
+		MappedSnapshot(const MappedSnapshot&) = delete;
+		MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+
+		~MappedSnapshot() {
+			unmap();
+		}
+
+		std::span<const double> pos(std::size_t d) const {
+			return block(d);
+		}
+
+		std::span<const double> vel(std::size_t d) const {
+			return block(header.dim + d);
+		}
+
+		std::span<const double> mass() const {
+			return block(2*header.dim);
+		}
+	};
+
+	/*
+	 * Writes snapshots on a background thread, so the simulation only pays
+	 * for copying the bodies. At most `max_pending` snapshots wait to be
+	 * written, further writes block until one is done.
+	 *
+	 * Snapshots go to `<simulation.snapshot.file>_<step>.bin`.
+	 */
+	class Writer {
+	private:
+		std::string prefix_;
+		std::size_t max_pending_;
+
+		std::deque<Snapshot> queue_;
+		std::mutex mutex_;
+		std::condition_variable changed_;
+		bool stop_ = false;
+
+		std::thread thread_;
+
+		void run() {
+			std::unique_lock lock(mutex_);
+			while (true) {
+				changed_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+				if (queue_.empty()) {
+					return;
+				}
+
+				auto& snap = queue_.front();
+				lock.unlock();
+
+				auto path = filename(snap.header.step);
+				try {
+					write(snap, path);
+				} catch (const std::exception& e) {
+					std::cout << "[snapshot::Writer] Error: " << e.what() << std::endl;
+				}
+
+				lock.lock();
+				queue_.pop_front();
+				changed_.notify_all();
+			}
+		}
+
+	public:
+		Writer(config::Config cfg) {
+			prefix_ = cfg.get<std::string>("simulation.snapshot.file").value_or("snapshot");
+			max_pending_ = std::max<std::size_t>(1, cfg.get<std::size_t>("simulation.snapshot.max_pending").value_or(2));
+
+			auto dir = std::filesystem::path(prefix_).parent_path();
+			if (!dir.empty()) {
+				std::filesystem::create_directories(dir);
+			}
+
+			thread_ = std::thread(&Writer::run, this);
+		}
+
+		Writer(const Writer&) = delete;
+		Writer& operator=(const Writer&) = delete;
+
+		/* Writes out all pending snapshots. */
+		~Writer() {
+			{
+				std::lock_guard lock(mutex_);
+				stop_ = true;
+			}
+			changed_.notify_all();
+			thread_.join();
+		}
+
+		std::string filename(std::size_t step) const {
+			auto num = std::to_string(step);
+			if (num.size() < 8) {
+				num.insert(0, 8 - num.size(), '0');
+			}
+			return prefix_ + "_" + num + ".bin";
+		}
+
+		void push(Snapshot&& snap) {
+			std::unique_lock lock(mutex_);
+			changed_.wait(lock, [this] { return queue_.size() < max_pending_; });
+			queue_.push_back(std::move(snap));
+			changed_.notify_all();
+		}
+	};
+}
+
+#endif
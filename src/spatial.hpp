@@ -1,6 +1,7 @@
 #ifndef GALAXY_SPATIAL_H
 #define GALAXY_SPATIAL_H
 #include <algorithm>
+#include <cmath>
 
 namespace spatial {
 	using Dimension = std::size_t;
@@ -175,7 +176,7 @@ namespace spatial {
 		};
 		Box(const Point<T, D>& center, const Vector<T, D>& extent): center(center), extent(extent) {};
 
-		bool contains(const Point<T, D>& pt) {
+		bool contains(const Point<T, D>& pt) const {
 			for (std::size_t dim = 0; dim < D; ++dim) {
 				if (center[dim] - extent[dim] > pt[dim] || center[dim] + extent[dim] < pt[dim]) {
 					return false;
@@ -184,7 +185,7 @@ namespace spatial {
 			return true;
 		}
 
-		bool intersects(const Box<T, D>& box) {
+		bool intersects(const Box<T, D>& box) const {
 			for (std::size_t dim = 0; dim < D; ++dim) {
 				if (center[dim]-box.center[dim] >= extent[dim]+box.extent[dim]) {
 					return false;
@@ -196,6 +197,57 @@ namespace spatial {
 		T s() const {
 			return *std::max_element(extent.cbegin(), extent.cend());
 		}
+
+		/* Distance from `pt` to the closest point of the box, 0 inside. */
+		T distance(const Point<T, D>& pt) const {
+			T res = 0;
+			for (std::size_t dim = 0; dim < D; ++dim) {
+				auto out = std::max(std::abs(pt[dim] - center[dim]) - extent[dim], T(0));
+				res += out*out;
+			}
+			return std::sqrt(res);
+		}
+
+		/* Grows the box to contain `pt`. */
+		void include(const Point<T, D>& pt) {
+			for (std::size_t dim = 0; dim < D; ++dim) {
+				auto lo = std::min(center[dim] - extent[dim], pt[dim]);
+				auto hi = std::max(center[dim] + extent[dim], pt[dim]);
+				center[dim] = (lo + hi)/2;
+				extent[dim] = (hi - lo)/2;
+			}
+		}
+
+		/* Grows the box to contain `box`. */
+		void include(const Box<T, D>& box) {
+			for (std::size_t dim = 0; dim < D; ++dim) {
+				auto lo = std::min(center[dim] - extent[dim], box.center[dim] - box.extent[dim]);
+				auto hi = std::max(center[dim] + extent[dim], box.center[dim] + box.extent[dim]);
+				center[dim] = (lo + hi)/2;
+				extent[dim] = (hi - lo)/2;
+			}
+		}
+
+		/* Index of the child box containing `pt`, bit d is set for the upper half along axis d. */
+		std::size_t octant(const Point<T, D>& pt) const {
+			std::size_t code = 0;
+			for (std::size_t dim = 0; dim < D; ++dim) {
+				if (pt[dim] > center[dim]) {
+					code |= 1 << dim;
+				}
+			}
+			return code;
+		}
+
+		Box<T, D> child(std::size_t code) const {
+			Box<T, D> res = *this;
+			for (std::size_t dim = 0; dim < D; ++dim) {
+				auto half = extent[dim]/2;
+				res.center[dim] += (code >> dim) & 1 ? half : -half;
+				res.extent[dim] = half;
+			}
+			return res;
+		}
 	};
 
 	template<typename T, Dimension N, Dimension M>
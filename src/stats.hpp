@@ -0,0 +1,273 @@
+#ifndef GALAXY_STATS_H
+#define GALAXY_STATS_H
+
+#include <array>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include <utility>
+#include <iostream>
+
+#include "config.hpp"
+#include "utils.hpp"
+
+
+/*
+ * Per-phase timers and tree walk counters.
+ *
+ * Everything here compiles to nothing unless the program is built with
+ * USE_STATS (cmake -DUSE_STATS=YES).
+ */
+namespace stats {
+#ifdef USE_STATS
+	inline constexpr bool enabled = true;
+#else
+	inline constexpr bool enabled = false;
+#endif
+
+	enum class Phase {
+		BUILD,
+		TRAVERSAL,
+		ENERGY,
+		RENDER,
+		INTEGRATION
+	};
+	inline constexpr std::size_t phase_count = 5;
+	inline constexpr std::array<const char*, phase_count> phase_names = {
+		"build", "traversal", "energy", "render", "integration"
+	};
+
+	enum class Counter {
+		NODES_OPENED,
+		CELL_INTERACTIONS,
+		PARTICLE_INTERACTIONS
+	};
+	inline constexpr std::size_t counter_count = 3;
+	inline constexpr std::array<const char*, counter_count> counter_names = {
+		"nodes_opened", "cell_interactions", "particle_interactions"
+	};
+
+	using Counters = std::array<std::uint64_t, counter_count>;
+
+	/*
+	 * Counters of every thread which counted something. Each thread only adds
+	 * to its own block, the blocks are summed by collect() on the simulation
+	 * thread between parallel loops, when the pool is idle.
+	 */
+	class Registry {
+	private:
+		std::mutex mutex_;
+		std::vector<std::shared_ptr<Counters>> blocks_;
+
+	public:
+		std::shared_ptr<Counters> add() {
+			std::lock_guard lock(mutex_);
+			return blocks_.emplace_back(std::make_shared<Counters>());
+		}
+
+		/* Sums the counters of all threads and resets them. */
+		Counters collect() {
+			std::lock_guard lock(mutex_);
+
+			Counters res = {};
+			for (auto&& block : blocks_) {
+				for (std::size_t c = 0; c < counter_count; ++c) {
+					res[c] += std::exchange((*block)[c], 0);
+				}
+			}
+			return res;
+		}
+	};
+
+	inline Registry registry;
+
+	inline void count(Counter counter, std::uint64_t n = 1) {
+		if constexpr (enabled) {
+			thread_local std::shared_ptr<Counters> block = registry.add();
+			(*block)[static_cast<std::size_t>(counter)] += n;
+		}
+	}
+
+	struct Step {
+		std::array<double, phase_count> ms = {};
+		Counters counters = {};
+		std::size_t max_depth = 0;
+
+		void add(const Step& other) {
+			for (std::size_t p = 0; p < phase_count; ++p) {
+				ms[p] += other.ms[p];
+			}
+			for (std::size_t c = 0; c < counter_count; ++c) {
+				counters[c] += other.counters[c];
+			}
+			max_depth = std::max(max_depth, other.max_depth);
+		}
+	};
+
+	/*
+	 * Timings and counters of the steps of one simulation.
+	 *
+	 * Phases are timed by the scopes returned from time(), a nested scope
+	 * pauses the enclosing one, so every moment counts towards one phase
+	 * only. Counters of the tree walks are collected by end_step(). With `simulation.stats.file`
+	 * set every step is written there, as JSON Lines if the name ends with
+	 * .json or .jsonl, as CSV otherwise. summary() averages the steps since
+	 * its last call for the periodic report.
+	 */
+	class Recorder {
+	public:
+		class Scope {
+		private:
+			using Clock = std::chrono::steady_clock;
+
+			Recorder* recorder_;
+			Phase phase_;
+			Scope* outer_ = nullptr;
+			Clock::time_point start_;
+
+			void add(Clock::time_point now) {
+				std::chrono::duration<double, std::milli> elapsed = now - start_;
+				recorder_->step_.ms[static_cast<std::size_t>(phase_)] += elapsed.count();
+			}
+
+		public:
+			Scope(Recorder& recorder, Phase phase): recorder_(&recorder), phase_(phase) {
+				if constexpr (enabled) {
+					start_ = Clock::now();
+					outer_ = std::exchange(recorder_->current_, this);
+					if (outer_) {
+						outer_->add(start_);
+					}
+				}
+			}
+
+			Scope(const Scope&) = delete;
+			Scope& operator=(const Scope&) = delete;
+
+			~Scope() {
+				if constexpr (enabled) {
+					auto now = Clock::now();
+					add(now);
+					recorder_->current_ = outer_;
+					if (outer_) {
+						outer_->start_ = now;
+					}
+				}
+			}
+		};
+
+	private:
+		Step step_;
+		Step total_;
+		Scope* current_ = nullptr;
+		std::size_t total_steps_ = 0;
+
+		std::ofstream file_;
+		bool json_ = false;
+
+		void write(std::size_t step) {
+			if (json_) {
+				file_ << "{\"step\": " << step;
+				for (std::size_t p = 0; p < phase_count; ++p) {
+					file_ << ", \"" << phase_names[p] << "_ms\": " << step_.ms[p];
+				}
+				for (std::size_t c = 0; c < counter_count; ++c) {
+					file_ << ", \"" << counter_names[c] << "\": " << step_.counters[c];
+				}
+				file_ << ", \"max_depth\": " << step_.max_depth << "}\n";
+			} else {
+				file_ << step;
+				for (auto ms : step_.ms) {
+					file_ << "," << ms;
+				}
+				for (auto count : step_.counters) {
+					file_ << "," << count;
+				}
+				file_ << "," << step_.max_depth << "\n";
+			}
+		}
+
+	public:
+		Recorder(config::Config cfg) {
+			auto path = cfg.get<std::string>("simulation.stats.file");
+			if (!path) {
+				return;
+			}
+
+			if constexpr (!enabled) {
+				std::cout << "[stats::Recorder] Warning: Built without USE_STATS, simulation.stats.file is ignored." << std::endl;
+				return;
+			}
+
+			file_.open(*path, std::ios::trunc);
+			if (!file_) {
+				throw config::configuration_error("Unable to open '" + *path + "'.");
+			}
+
+			json_ = path->ends_with(".json") || path->ends_with(".jsonl");
+			if (!json_) {
+				file_ << "step";
+				for (auto name : phase_names) {
+					file_ << "," << name << "_ms";
+				}
+				for (auto name : counter_names) {
+					file_ << "," << name;
+				}
+				file_ << ",max_depth\n";
+			}
+		}
+
+		[[nodiscard]] Scope time(Phase phase) {
+			return Scope(*this, phase);
+		}
+
+		void depth(std::size_t depth) {
+			if constexpr (enabled) {
+				step_.max_depth = std::max(step_.max_depth, depth);
+			}
+		}
+
+		/* Collects the counters and closes the record of step `step`. */
+		void end_step(std::size_t step) {
+			if constexpr (enabled) {
+				step_.counters = registry.collect();
+				if (file_.is_open()) {
+					write(step);
+				}
+
+				total_.add(step_);
+				++total_steps_;
+				step_ = Step {};
+			}
+		}
+
+		/* Averages per step since the last summary, empty when there are none. */
+		std::string summary() {
+			if (!enabled || total_steps_ == 0) {
+				return {};
+			}
+
+			std::stringstream ss;
+			ss << "per step";
+			for (std::size_t p = 0; p < phase_count; ++p) {
+				ss << (p ? ", " : " ") << phase_names[p] << " " << formatf(total_.ms[p]/total_steps_, 2) << " ms";
+			}
+			for (std::size_t c = 0; c < counter_count; ++c) {
+				ss << ", " << counter_names[c] << " " << total_.counters[c]/total_steps_;
+			}
+			ss << ", max_depth " << total_.max_depth;
+
+			total_ = Step {};
+			total_steps_ = 0;
+			return ss.str();
+		}
+	};
+}
+
+#endif